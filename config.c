@@ -13,18 +13,411 @@
 
 #define PARSEERROR fprintf(stderr,"LIBUSB-DRIVER WARNING: Invalid config statement at line %d\n", line)
 
-static struct parport_config pp_config[4];
+/* LPT1 up to the highest port in the config file, at least CONFIG_PORTS */
+static struct parport_config *pp_config;
+static int pp_ports;
+static struct ftdi_config xpcu_ftdi;
+
+/* Add real parallel ports to the table until it has num entries */
+static int grow_ports(int num) {
+	struct parport_config *p;
+	int i;
+
+	if (num <= pp_ports)
+		return 0;
+
+	if (!(p = realloc(pp_config, num * sizeof(struct parport_config))))
+		return -1;
+
+	pp_config = p;
+
+	for (i = pp_ports; i < num; i++) {
+		memset(&pp_config[i], 0, sizeof(struct parport_config));
+		pp_config[i].num = i;
+		pp_config[i].ppbase = i*0x10;
+		pp_config[i].real = 1;
+		pp_config[i].open = parport_open;
+		pp_config[i].close = parport_close;
+		pp_config[i].transfer = parport_transfer;
+	}
+
+	pp_ports = num;
+
+	return 0;
+}
+
+/* Parse "PPDEV:<device>" starting at buf[i] */
+static int parse_ppdev(char *buf, int i, int len, char **dev) {
+	char *pbuf;
+
+	if (strncasecmp(buf+i, "PPDEV:", 6))
+		return -1;
+
+	i += 6;
+	pbuf = buf + i;
+
+	for (; i < len; i++) {
+		if (buf[i] == ' ' || buf[i] == '\t')
+			break;
+	}
+
+	if (pbuf == buf + i)
+		return -1;
+
+	buf[i] = '\0';
+	for (i++; i < len; i++) {
+		if (buf[i] != ' ' && buf[i] != '\t')
+			break;
+	}
+
+	if (i < len && buf[i] != '#' && buf[i] != ';')
+		return -1;
+
+	if (!(*dev = strdup(pbuf)))
+		return -1;
+
+	return 0;
+}
+
+/* Parse "DIRECT[:iobase]" starting at buf[i], iobase 0 if not given */
+static int parse_direct(char *buf, int i, int len, unsigned long *iobase) {
+	char *end;
+
+	if (strncasecmp(buf+i, "DIRECT", 6))
+		return -1;
+
+	i += 6;
+	*iobase = 0;
+
+	if (buf[i] == ':') {
+		i++;
+		*iobase = strtoul(buf+i, &end, 0);
+		if (end == buf+i || !*iobase || *iobase > 0xfffd)
+			return -1;
+
+		i = end - buf;
+	}
+
+	for (; i < len; i++) {
+		if (buf[i] != ' ' && buf[i] != '\t')
+			break;
+	}
+
+	if (i < len && buf[i] != '#' && buf[i] != ';')
+		return -1;
+
+	return 0;
+}
+
+#ifdef JTAGKEY
+#define MAX_LAYOUTS 16
+
+/*
+ * Pin layouts, the first one is used when none is given. It only drives
+ * the JTAG pins and leaves ACBUS alone, like older versions did. The
+ * presets also put nTRST and nSRST into their inactive state.
+ */
+static struct jtagkey_layout layouts[MAX_LAYOUTS] = {
+	{
+		.name = "default",
+		.tck = 0x01, .tdi = 0x02, .tdo = 0x04, .tms = 0x08,
+		.oe = 0x10, .oe_low = 1,
+	},
+	{
+		.name = "jtagkey",
+		.tck = 0x01, .tdi = 0x02, .tdo = 0x04, .tms = 0x08,
+		.oe = 0x10, .oe_low = 1,
+		/* nTRST high, nTRST buffer on, nSRST buffer off */
+		.high_value = 0x09, .high_dir = 0x0f,
+	},
+};
+
+/*
+ * Cables with the same initial ACBUS state as the JTAGkey. The Bus Blaster
+ * emulates a JTAGkey, the Olimex ARM-USB-OCD drives nSRST through an
+ * inverter on ACBUS1 and its red LED on ACBUS3, so the same 0x09 releases
+ * nTRST and nSRST and turns the LED on.
+ */
+static const char *layout_aliases[][2] = {
+	{ "busblaster", "jtagkey" },
+	{ "olimex", "jtagkey" },
+};
+
+static const struct jtagkey_layout *find_layout(const char *name) {
+	int i;
+
+	for (i = 0; i < sizeof(layout_aliases) / sizeof(layout_aliases[0]); i++) {
+		if (!strcasecmp(layout_aliases[i][0], name)) {
+			name = layout_aliases[i][1];
+			break;
+		}
+	}
+
+	for (i = 0; i < MAX_LAYOUTS && layouts[i].name; i++) {
+		if (!strcasecmp(layouts[i].name, name))
+			return &layouts[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Parse the pins of a LAYOUT statement:
+ *   tck=, tdi=, tdo=, tms=	bit of the signal on ADBUS
+ *   ntdo=			TDO inverted by the cable
+ *   oe=, noe=			output enable, active high or low
+ *   high=<value>:<direction>	initial state of ACBUS
+ */
+static int parse_layout(char *buf, int i, int len, struct jtagkey_layout *l) {
+	unsigned char *pin;
+	char *end;
+	unsigned long val;
+
+	while (i < len) {
+		for (; i < len; i++) {
+			if (buf[i] != ' ' && buf[i] != '\t')
+				break;
+		}
+
+		if (i >= len || buf[i] == '#' || buf[i] == ';')
+			break;
+
+		pin = NULL;
+		if (!strncasecmp(buf+i, "tck=", 4)) {
+			pin = &l->tck;
+			i += 4;
+		} else if (!strncasecmp(buf+i, "tdi=", 4)) {
+			pin = &l->tdi;
+			i += 4;
+		} else if (!strncasecmp(buf+i, "tdo=", 4)) {
+			pin = &l->tdo;
+			l->tdo_low = 0;
+			i += 4;
+		} else if (!strncasecmp(buf+i, "ntdo=", 5)) {
+			pin = &l->tdo;
+			l->tdo_low = 1;
+			i += 5;
+		} else if (!strncasecmp(buf+i, "tms=", 4)) {
+			pin = &l->tms;
+			i += 4;
+		} else if (!strncasecmp(buf+i, "oe=", 3)) {
+			pin = &l->oe;
+			l->oe_low = 0;
+			i += 3;
+		} else if (!strncasecmp(buf+i, "noe=", 4)) {
+			pin = &l->oe;
+			l->oe_low = 1;
+			i += 4;
+		} else if (!strncasecmp(buf+i, "high=", 5)) {
+			i += 5;
+		} else {
+			return -1;
+		}
+
+		if (pin) {
+			val = strtoul(buf+i, &end, 0);
+			if (end == buf+i || val > 0xff)
+				return -1;
+
+			*pin = val;
+		} else {
+			val = strtoul(buf+i, &end, 0);
+			if (end == buf+i || val > 0xff || *end != ':')
+				return -1;
+
+			l->high_value = val;
+
+			i = end + 1 - buf;
+			val = strtoul(buf+i, &end, 0);
+			if (end == buf+i || val > 0xff)
+				return -1;
+
+			l->high_dir = val;
+		}
+
+		if (*end != '\0' && *end != ' ' && *end != '\t')
+			return -1;
+
+		i = end - buf;
+	}
+
+	return 0;
+}
+
+/* Parse "FTDI:vid:pid[:interface]" starting at buf[i] */
+static int parse_ftdi(char *buf, int i, int len, unsigned short *vid, unsigned short *pid, unsigned short *iface) {
+	char *pbuf;
+
+	if (strncasecmp(buf+i, "FTDI:", 5))
+		return -1;
+
+	i += 5;
+	pbuf = buf + i;
+
+	for (; i < len; i++) {
+		if (buf[i] == ':')
+			break;
+	}
+
+	if (buf[i] != ':')
+		return -1;
+
+	buf[i] = '\0';
+
+	*vid = strtol(pbuf, NULL, 16);
+	if (!*vid)
+		return -1;
+
+	i++;
+	pbuf = buf + i;
+
+	for (; i < len; i++) {
+		if (buf[i] == ' ' || buf[i] == '\t' || buf[i] == ':')
+			break;
+	}
+
+	*pid = strtol(pbuf, NULL, 16);
+	if (!*pid)
+		return -1;
+
+	*iface = 0;
+	pbuf = buf + i;
+	if (pbuf[0] == ':') {
+		*iface = atoi(pbuf + 1);
+		for (i++; i < len; i++) {
+			if (buf[i] == ' ' || buf[i] == '\t')
+				break;
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Parse the options following the FTDI spec:
+ *   speed=<Hz>[k|M]	TCK frequency
+ *   speed=auto		find the fastest working TCK frequency
+ *   rtck		adaptive clocking (H-series chips)
+ *   async		queued libusb-1.0 transfers instead of libftdi
+ *   layout=<name>	pin layout, a preset or defined with LAYOUT before
+ *   serial=<serial>	the cable with this serial number
+ */
+static int parse_options(char *buf, int i, int len, unsigned long *speed, unsigned int *flags, const struct jtagkey_layout **layout, char **serial) {
+	char *end;
+	int ret = 0;
+
+	*speed = 0;
+	*flags = 0;
+	*layout = &layouts[0];
+	*serial = NULL;
+
+	while (i < len) {
+		for (; i < len; i++) {
+			if (buf[i] != ' ' && buf[i] != '\t')
+				break;
+		}
+
+		if (i >= len || buf[i] == '#' || buf[i] == ';')
+			break;
+
+		if (!strncasecmp(buf+i, "rtck", 4)) {
+			*flags |= CONFIG_FLAG_RTCK;
+			end = buf + i + 4;
+		} else if (!strncasecmp(buf+i, "async", 5)) {
+			*flags |= CONFIG_FLAG_ASYNC;
+			end = buf + i + 5;
+		} else if (!strncasecmp(buf+i, "layout=", 7)) {
+			char c;
+
+			i += 7;
+			for (end = buf + i; *end && *end != ' ' && *end != '\t'; end++);
+
+			c = *end;
+			*end = '\0';
+			*layout = find_layout(buf + i);
+			*end = c;
+
+			if (!*layout) {
+				fprintf(stderr, "LIBUSB-DRIVER WARNING: Unknown pin layout %s\n", buf + i);
+				ret = -1;
+				break;
+			}
+		} else if (!strncasecmp(buf+i, "serial=", 7)) {
+			char c;
+
+			i += 7;
+			for (end = buf + i; *end && *end != ' ' && *end != '\t'; end++);
+
+			if (end == buf + i) {
+				ret = -1;
+				break;
+			}
+
+			c = *end;
+			*end = '\0';
+			free(*serial);
+			*serial = strdup(buf + i);
+			*end = c;
+
+			if (!*serial) {
+				ret = -1;
+				break;
+			}
+		} else if (!strncasecmp(buf+i, "speed=auto", 10)) {
+			*speed = CONFIG_SPEED_AUTO;
+			end = buf + i + 10;
+		} else if (!strncasecmp(buf+i, "speed=", 6)) {
+			i += 6;
+			*speed = strtoul(buf+i, &end, 10);
+			if (end == buf+i || !*speed) {
+				ret = -1;
+				break;
+			}
+
+			if (*end == 'k' || *end == 'K') {
+				*speed *= 1000;
+				end++;
+			} else if (*end == 'M') {
+				*speed *= 1000000;
+				end++;
+			}
+		} else {
+			ret = -1;
+			break;
+		}
+
+		if (*end != '\0' && *end != ' ' && *end != '\t') {
+			ret = -1;
+			break;
+		}
+
+		i = end - buf;
+	}
+
+	if (ret) {
+		free(*serial);
+		*serial = NULL;
+	}
+
+	return ret;
+}
+#endif
 
 static void read_config() {
 	int i;
 	static int config_read = 0;
 	FILE *cfg;
 	char buf[LINELEN];
-#ifdef JTAGKEY
 	char *pbuf;
+	unsigned long iobase;
+	int line, len, num;
+#ifdef JTAGKEY
 	unsigned short vid, pid;
 	unsigned short iface;
-	int line, len, num;
+	unsigned long speed;
+	unsigned int flags;
+	const struct jtagkey_layout *layout;
+	char *serial;
 #endif
 
 	if (config_read)
@@ -32,20 +425,15 @@ static void read_config() {
 	
 	config_read = 1;
 
-	for (i=0; i<sizeof(pp_config)/sizeof(struct parport_config); i++) {
-		pp_config[i].num = i;
-		pp_config[i].ppbase = i*0x10;
-		pp_config[i].real = 1;
-		pp_config[i].open = parport_open;
-		pp_config[i].close = parport_close;
-		pp_config[i].transfer = parport_transfer;
+	if (grow_ports(CONFIG_PORTS) < 0) {
+		fprintf(stderr, "LIBUSB-DRIVER WARNING: Can't allocate the parallel port table\n");
+		return;
 	}
 
 	snprintf(buf, sizeof(buf), "%s/.libusb-driverrc", getenv("HOME"));
 
 	cfg = fopen(buf, "r");
 	if (cfg) {
-#ifdef JTAGKEY
 		line = 0;
 		do {
 			pbuf = fgets(buf, sizeof(buf), cfg);
@@ -96,7 +484,7 @@ static void read_config() {
 
 				num = 0;
 				num = strtol(pbuf, NULL, 10);
-				if (num < 1) {
+				if (num < 1 || num > CONFIG_MAX_PORTS || grow_ports(num) < 0) {
 					PARSEERROR;
 					continue;
 				}
@@ -122,79 +510,145 @@ static void read_config() {
 						break;
 				}
 
-				if (strncasecmp(buf+i, "FTDI:", 5)) {
-					PARSEERROR;
+				if (!strncasecmp(buf+i, "DIRECT", 6)) {
+					/* real port, but with inb/outb instead of ppdev */
+					if (parse_direct(buf, i, len, &iobase) < 0) {
+						PARSEERROR;
+						continue;
+					}
+
+					pp_config[num].direct = 1;
+					pp_config[num].iobase = iobase;
 					continue;
 				}
 
-				i += 5;
-				pbuf = buf + i;
+				if (!strncasecmp(buf+i, "PPDEV:", 6)) {
+					/* real port on another ppdev device than parport<n-1> */
+					if (parse_ppdev(buf, i, len, &pp_config[num].ppdev) < 0) {
+						PARSEERROR;
+						continue;
+					}
 
-				for (; i < len; i++) {
-					if (buf[i] == ':')
+					continue;
+				}
+
+#ifdef JTAGKEY
+				if ((i = parse_ftdi(buf, i, len, &vid, &pid, &iface)) < 0 ||
+						parse_options(buf, i, len, &speed, &flags, &layout, &serial) < 0) {
+					PARSEERROR;
+					continue;
+				}
+
+				pp_config[num].real = 0;
+				pp_config[num].usb_vid = vid;
+				pp_config[num].usb_pid = pid;
+				pp_config[num].usb_iface = iface;
+				pp_config[num].usb_serial = serial;
+				pp_config[num].usb_speed = speed;
+				pp_config[num].usb_flags = flags;
+				pp_config[num].usb_layout = layout;
+				pp_config[num].open = jtagkey_open;
+				pp_config[num].close = jtagkey_close;
+				pp_config[num].transfer = jtagkey_transfer;
+#else
+				fprintf(stderr,"libusb-driver not compiled with FTDI2232-support, LPT%d ignored!\n", num + 1);
+#endif
+#ifdef JTAGKEY
+			} else if (!strncasecmp(buf+i, "XPCU", 4)) {
+				/* FTDI cable presented to impact as Platform Cable USB */
+				for (i += 4; i < len; i++) {
+					if (buf[i] != ' ' && buf[i] != '\t')
 						break;
 				}
 
-				if (buf[i] != ':') {
+				if (buf[i] != '=') {
 					PARSEERROR;
 					continue;
 				}
 
-				buf[i] = '\0';
+				for (i++; i < len; i++) {
+					if (buf[i] != ' ' && buf[i] != '\t')
+						break;
+				}
 
-				vid = 0;
-				vid = strtol(pbuf, NULL, 16);
-				if (!vid) {
+				if ((i = parse_ftdi(buf, i, len, &vid, &pid, &iface)) < 0 ||
+						parse_options(buf, i, len, &speed, &flags, &layout, &serial) < 0) {
 					PARSEERROR;
 					continue;
 				}
 
-				i++;
+				xpcu_ftdi.usb_vid = vid;
+				xpcu_ftdi.usb_pid = pid;
+				xpcu_ftdi.usb_iface = iface;
+				xpcu_ftdi.usb_serial = serial;
+				xpcu_ftdi.usb_speed = speed;
+				xpcu_ftdi.usb_flags = flags;
+				xpcu_ftdi.usb_layout = layout;
+			} else if (!strncasecmp(buf+i, "LAYOUT", 6)) {
+				struct jtagkey_layout *l;
+				int n, nameend;
+
+				for (i += 6; i < len; i++) {
+					if (buf[i] != ' ' && buf[i] != '\t')
+						break;
+				}
+
 				pbuf = buf + i;
+				for (; i < len; i++) {
+					if (buf[i] == ' ' || buf[i] == '\t' || buf[i] == '=')
+						break;
+				}
+				nameend = i;
 
 				for (; i < len; i++) {
-					if (buf[i] == ' ' || buf[i] == '\t' || buf[i] == ':')
+					if (buf[i] != ' ' && buf[i] != '\t')
 						break;
 				}
 
-				pid = 0;
-				pid = strtol(pbuf, NULL, 16);
-				if (!pid) {
+				if (pbuf == buf + nameend || buf[i] != '=') {
 					PARSEERROR;
 					continue;
 				}
 
-				iface = 0;
-				pbuf = buf + i;
-				if (pbuf[0] == ':') {
-					iface = atoi(pbuf + 1);
+				buf[nameend] = '\0';
+				i++;
+
+				for (n = 0; n < MAX_LAYOUTS && layouts[n].name; n++);
+				if (n == MAX_LAYOUTS || find_layout(pbuf)) {
+					PARSEERROR;
+					continue;
 				}
 
-				pp_config[num].real = 0;
-				pp_config[num].usb_vid = vid;
-				pp_config[num].usb_pid = pid;
-				pp_config[num].usb_iface = iface;
-				pp_config[num].open = jtagkey_open;
-				pp_config[num].close = jtagkey_close;
-				pp_config[num].transfer = jtagkey_transfer;
+				/* start from the default wiring */
+				l = &layouts[n];
+				*l = layouts[0];
+				if (parse_layout(buf, i, len, l) < 0 || !(l->name = strdup(pbuf))) {
+					l->name = NULL;
+					PARSEERROR;
+					continue;
+				}
+#endif
 			} else {
 				PARSEERROR;
 			}
 		} while (pbuf);
-#else
-		fprintf(stderr,"libusb-driver not compiled with FTDI2232-support, config file ignored!\n");
-#endif
 		fclose(cfg);
 	}
 }
 
+int config_num_ports(void) {
+	read_config();
+
+	return pp_ports;
+}
+
 struct parport_config *config_get(int num) {
 	struct parport_config *ret = NULL;
 	int i;
 
 	read_config();
 	
-	for (i=0; i<sizeof(pp_config)/sizeof(struct parport_config); i++) {
+	for (i=0; i<pp_ports; i++) {
 		if (pp_config[i].num == num) {
 			ret = &(pp_config[i]);
 			break;
@@ -210,7 +664,7 @@ unsigned char config_is_real_pport(int num) {
 
 	read_config();
 	
-	for (i=0; i<sizeof(pp_config)/sizeof(struct parport_config); i++) {
+	for (i=0; i<pp_ports; i++) {
 		if (pp_config[i].num == num) {
 			ret = pp_config[i].real;
 			break;
@@ -220,13 +674,61 @@ unsigned char config_is_real_pport(int num) {
 	return ret;
 }
 
+unsigned char config_pport_direct(int num) {
+	unsigned char ret = 0;
+	int i;
+
+	read_config();
+
+	for (i=0; i<pp_ports; i++) {
+		if (pp_config[i].num == num) {
+			ret = pp_config[i].direct;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+const char *config_pport_device(int num) {
+	const char *ret = NULL;
+	int i;
+
+	read_config();
+
+	for (i=0; i<pp_ports; i++) {
+		if (pp_config[i].num == num) {
+			ret = pp_config[i].ppdev;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+unsigned long config_pport_iobase(int num) {
+	unsigned long ret = 0;
+	int i;
+
+	read_config();
+
+	for (i=0; i<pp_ports; i++) {
+		if (pp_config[i].num == num) {
+			ret = pp_config[i].iobase;
+			break;
+		}
+	}
+
+	return ret;
+}
+
 unsigned short config_usb_vid(int num) {
 	unsigned short ret = 0x00;
 	int i;
 	
 	read_config();
 	
-	for (i=0; i<sizeof(pp_config)/sizeof(struct parport_config); i++) {
+	for (i=0; i<pp_ports; i++) {
 		if (pp_config[i].num == num) {
 			ret = pp_config[i].usb_vid;
 			break;
@@ -242,7 +744,7 @@ unsigned short config_usb_pid(int num) {
 	
 	read_config();
 	
-	for (i=0; i<sizeof(pp_config)/sizeof(struct parport_config); i++) {
+	for (i=0; i<pp_ports; i++) {
 		if (pp_config[i].num == num) {
 			ret = pp_config[i].usb_pid;
 			break;
@@ -252,13 +754,22 @@ unsigned short config_usb_pid(int num) {
 	return ret;
 }
 
+struct ftdi_config *config_xpcu_ftdi(void) {
+	read_config();
+
+	if (!xpcu_ftdi.usb_vid)
+		return NULL;
+
+	return &xpcu_ftdi;
+}
+
 unsigned short config_usb_iface(int num) {
 	unsigned short ret = 0x00;
 	int i;
 	
 	read_config();
 	
-	for (i=0; i<sizeof(pp_config)/sizeof(struct parport_config); i++) {
+	for (i=0; i<pp_ports; i++) {
 		if (pp_config[i].num == num) {
 			ret = pp_config[i].usb_iface;
 			break;
@@ -268,3 +779,72 @@ unsigned short config_usb_iface(int num) {
 	return ret;
 }
 
+
+unsigned long config_usb_speed(int num) {
+	unsigned long ret = 0;
+	int i;
+	
+	read_config();
+	
+	for (i=0; i<pp_ports; i++) {
+		if (pp_config[i].num == num) {
+			ret = pp_config[i].usb_speed;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+const char *config_usb_serial(int num) {
+	const char *ret = NULL;
+	int i;
+
+	read_config();
+
+	for (i=0; i<pp_ports; i++) {
+		if (pp_config[i].num == num) {
+			ret = pp_config[i].usb_serial;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+unsigned int config_usb_flags(int num) {
+	unsigned int ret = 0;
+	int i;
+	
+	read_config();
+	
+	for (i=0; i<pp_ports; i++) {
+		if (pp_config[i].num == num) {
+			ret = pp_config[i].usb_flags;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+const struct jtagkey_layout *config_usb_layout(int num) {
+	const struct jtagkey_layout *ret = NULL;
+	int i;
+	
+	read_config();
+	
+	for (i=0; i<pp_ports; i++) {
+		if (pp_config[i].num == num) {
+			ret = pp_config[i].usb_layout;
+			break;
+		}
+	}
+
+#ifdef JTAGKEY
+	if (!ret)
+		ret = &layouts[0];
+#endif
+
+	return ret;
+}
@@ -1,17 +1,60 @@
+struct jtagkey_layout;
+
+/*
+ * Parallel ports LPT1-4 always exist, more can be added in the config file.
+ * The I/O base of port n is n * 0x10, they have to stay below the ECP
+ * registers of the first port at 0x400.
+ */
+#define CONFIG_PORTS 4
+#define CONFIG_MAX_PORTS 64
+
 struct parport_config {
 	int num;
 	unsigned long ppbase;
 	unsigned char real;
+	unsigned char direct;		/* real port accessed with inb/outb */
+	unsigned long iobase;		/* of the direct port, 0 to look it up */
+	char *ppdev;			/* device of the real port, NULL for /dev/parport<num> */
 	unsigned short usb_vid;
 	unsigned short usb_pid;
 	unsigned short usb_iface;
+	char *usb_serial;
+	unsigned long usb_speed;
+	unsigned int usb_flags;
+	const struct jtagkey_layout *usb_layout;
 	int (*open) (int num);
 	void (*close) (int handle);
 	int (*transfer) (WD_TRANSFER *tr, int fd, unsigned int request, int ppbase, int ecpbase, int num);
 };
 
+struct ftdi_config {
+	unsigned short usb_vid;
+	unsigned short usb_pid;
+	unsigned short usb_iface;
+	char *usb_serial;		/* NULL for the first cable with vid:pid */
+	unsigned long usb_speed;
+	unsigned int usb_flags;
+	const struct jtagkey_layout *usb_layout;
+};
+
+/* usb_speed: 0 for the default TCK frequency, or: */
+#define CONFIG_SPEED_AUTO	((unsigned long)-1)
+
+/* usb_flags */
+#define CONFIG_FLAG_RTCK	0x01
+#define CONFIG_FLAG_ASYNC	0x02
+
+int __attribute__ ((visibility ("hidden"))) config_num_ports(void);
 struct parport_config __attribute__ ((visibility ("hidden"))) *config_get(int num);
 unsigned char __attribute__ ((visibility ("hidden"))) config_is_real_pport(int num);
+unsigned char __attribute__ ((visibility ("hidden"))) config_pport_direct(int num);
+unsigned long __attribute__ ((visibility ("hidden"))) config_pport_iobase(int num);
+const char __attribute__ ((visibility ("hidden"))) *config_pport_device(int num);
 unsigned short __attribute__ ((visibility ("hidden"))) config_usb_vid(int num);
 unsigned short __attribute__ ((visibility ("hidden"))) config_usb_pid(int num);
 unsigned short __attribute__ ((visibility ("hidden"))) config_usb_iface(int num);
+const char __attribute__ ((visibility ("hidden"))) *config_usb_serial(int num);
+unsigned long __attribute__ ((visibility ("hidden"))) config_usb_speed(int num);
+unsigned int __attribute__ ((visibility ("hidden"))) config_usb_flags(int num);
+const struct jtagkey_layout __attribute__ ((visibility ("hidden"))) *config_usb_layout(int num);
+struct ftdi_config __attribute__ ((visibility ("hidden"))) *config_xpcu_ftdi(void);
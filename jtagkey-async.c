@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftdi.h>
+#include <libusb.h>
+#include "usb-driver.h"
+#include "jtagkey-async.h"
+
+/*
+ * Bulk transport for FTDI chips using libusb-1.0 asynchronous transfers.
+ * libftdi still does all the control requests, only the data endpoints
+ * are moved over: several OUT and IN transfers are kept queued, so the
+ * chip never waits for the host during long streams.
+ */
+
+/* Transfers in flight per direction, and their size */
+#define ASYNC_URBS 8
+#define ASYNC_CHUNK 16384
+#define ASYNC_TIMEOUT 5000
+
+struct jtagkey_async;
+
+struct async_urb {
+	struct jtagkey_async *a;
+	struct libusb_transfer *t;
+	unsigned char *buf;		/* IN transfers only */
+	int busy;
+};
+
+struct jtagkey_async {
+	libusb_context *ctx;
+	libusb_device_handle *dev;
+	int iface;
+	unsigned char in_ep;
+	unsigned char out_ep;
+	int packet;			/* max packet size, 2 status bytes each */
+	struct async_urb out[ASYNC_URBS];
+	struct async_urb in[ASYNC_URBS];
+	/* the request in progress */
+	unsigned char *wbuf;
+	int wlen, wpos;
+	unsigned char *rbuf;
+	int rlen, rpos;
+	int busy;			/* transfers submitted, not completed */
+	int err;
+};
+
+/*
+ * Copy the payload of the packets in buf to the read buffer. A short packet
+ * ends a USB transfer, so only the last one can be shorter than a->packet,
+ * e.g. the 2 status bytes alone when the chip had nothing else to send.
+ */
+static void async_compact(struct jtagkey_async *a, unsigned char *buf, int len) {
+	int n;
+
+	for (; len > 2; buf += a->packet, len -= a->packet) {
+		n = ((len < a->packet) ? len : a->packet) - 2;
+
+		if (n > a->rlen - a->rpos)
+			n = a->rlen - a->rpos;
+
+		memcpy(a->rbuf + a->rpos, buf + 2, n);
+		a->rpos += n;
+	}
+}
+
+static void async_cancel(struct async_urb *urbs) {
+	int i;
+
+	for (i = 0; i < ASYNC_URBS; i++) {
+		if (urbs[i].busy)
+			libusb_cancel_transfer(urbs[i].t);
+	}
+}
+
+static void async_fail(struct jtagkey_async *a) {
+	a->err = -EIO;
+	async_cancel(a->out);
+	async_cancel(a->in);
+}
+
+static int async_submit(struct async_urb *u) {
+	if (libusb_submit_transfer(u->t) != 0)
+		return -EIO;
+
+	u->busy = 1;
+	u->a->busy++;
+
+	return 0;
+}
+
+static int async_submit_out(struct jtagkey_async *a, struct async_urb *u);
+
+static void LIBUSB_CALL async_out_done(struct libusb_transfer *t) {
+	struct async_urb *u = (struct async_urb*)t->user_data;
+	struct jtagkey_async *a = u->a;
+
+	u->busy = 0;
+	a->busy--;
+
+	if (t->status == LIBUSB_TRANSFER_CANCELLED || a->err)
+		return;
+
+	if (t->status != LIBUSB_TRANSFER_COMPLETED || t->actual_length != t->length) {
+		fprintf(stderr, "FTDI async write failed: status %d, %d of %d bytes\n",
+				t->status, t->actual_length, t->length);
+		async_fail(a);
+		return;
+	}
+
+	if (a->wpos < a->wlen && async_submit_out(a, u) != 0)
+		async_fail(a);
+}
+
+static int async_submit_out(struct jtagkey_async *a, struct async_urb *u) {
+	int len = a->wlen - a->wpos;
+
+	if (len > ASYNC_CHUNK)
+		len = ASYNC_CHUNK;
+
+	libusb_fill_bulk_transfer(u->t, a->dev, a->out_ep, a->wbuf + a->wpos, len,
+			async_out_done, u, ASYNC_TIMEOUT);
+
+	if (async_submit(u) != 0)
+		return -EIO;
+
+	a->wpos += len;
+
+	return 0;
+}
+
+static void LIBUSB_CALL async_in_done(struct libusb_transfer *t) {
+	struct async_urb *u = (struct async_urb*)t->user_data;
+	struct jtagkey_async *a = u->a;
+
+	u->busy = 0;
+	a->busy--;
+
+	if (t->status == LIBUSB_TRANSFER_CANCELLED || a->err)
+		return;
+
+	if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+		fprintf(stderr, "FTDI async read failed: status %d, %d of %d bytes read\n",
+				t->status, a->rpos, a->rlen);
+		async_fail(a);
+		return;
+	}
+
+	async_compact(a, t->buffer, t->actual_length);
+
+	/* Everything is there, the other reads can only get status bytes */
+	if (a->rpos >= a->rlen) {
+		async_cancel(a->in);
+		return;
+	}
+
+	if (async_submit(u) != 0)
+		async_fail(a);
+}
+
+/* Write wlen bytes and read rlen bytes of payload at the same time */
+int jtagkey_async_xfer(struct jtagkey_async *a, unsigned char *wbuf, int wlen, unsigned char *rbuf, int rlen) {
+	int i;
+
+	a->wbuf = wbuf;
+	a->wlen = wlen;
+	a->wpos = 0;
+	a->rbuf = rbuf;
+	a->rlen = rlen;
+	a->rpos = 0;
+	a->busy = 0;
+	a->err = 0;
+
+	/* reads first, the chip answers as soon as the first packet is out */
+	for (i = 0; i < ASYNC_URBS && rlen && !a->err; i++) {
+		libusb_fill_bulk_transfer(a->in[i].t, a->dev, a->in_ep, a->in[i].buf, ASYNC_CHUNK,
+				async_in_done, &(a->in[i]), ASYNC_TIMEOUT);
+
+		if (async_submit(&(a->in[i])) != 0)
+			async_fail(a);
+	}
+
+	for (i = 0; i < ASYNC_URBS && a->wpos < a->wlen && !a->err; i++) {
+		if (async_submit_out(a, &(a->out[i])) != 0)
+			async_fail(a);
+	}
+
+	while (a->busy) {
+		if (libusb_handle_events_completed(a->ctx, NULL) != 0 && !a->err)
+			async_fail(a);
+	}
+
+	return a->err;
+}
+
+/* Take the data endpoints of the device opened by libftdi over */
+struct jtagkey_async *jtagkey_async_open(struct ftdi_context *ftdic) {
+	struct usb_device *udev = usb_device(ftdic->usb_dev);
+	struct jtagkey_async *a;
+	libusb_device **list;
+	ssize_t n;
+	int i, ret;
+
+	if (!udev || !(a = calloc(1, sizeof(struct jtagkey_async))))
+		return NULL;
+
+	a->iface = ftdic->interface;
+	/* libftdi names the endpoints from the chip's side */
+	a->in_ep = ftdic->out_ep;
+	a->out_ep = ftdic->in_ep;
+	a->packet = ftdic->max_packet_size ? ftdic->max_packet_size : 64;
+
+	if ((ret = libusb_init(&a->ctx)) != 0) {
+		fprintf(stderr, "unable to initialise libusb-1.0: %s\n", libusb_error_name(ret));
+		free(a);
+		return NULL;
+	}
+
+	if ((n = libusb_get_device_list(a->ctx, &list)) < 0) {
+		libusb_exit(a->ctx);
+		free(a);
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (libusb_get_bus_number(list[i]) == atoi(udev->bus->dirname) &&
+				libusb_get_device_address(list[i]) == udev->devnum) {
+			if ((ret = libusb_open(list[i], &a->dev)) != 0)
+				fprintf(stderr, "unable to open FTDI device with libusb-1.0: %s\n", libusb_error_name(ret));
+			break;
+		}
+	}
+
+	libusb_free_device_list(list, 1);
+
+	if (!a->dev) {
+		libusb_exit(a->ctx);
+		free(a);
+		return NULL;
+	}
+
+	/* control requests go to the device, they still work through libftdi */
+	usb_release_interface(ftdic->usb_dev, a->iface);
+
+	if ((ret = libusb_claim_interface(a->dev, a->iface)) != 0) {
+		fprintf(stderr, "unable to claim FTDI interface %d: %s\n", a->iface, libusb_error_name(ret));
+		usb_claim_interface(ftdic->usb_dev, a->iface);
+		libusb_close(a->dev);
+		libusb_exit(a->ctx);
+		free(a);
+		return NULL;
+	}
+
+	for (i = 0; i < ASYNC_URBS; i++) {
+		a->out[i].a = a;
+		a->out[i].t = libusb_alloc_transfer(0);
+		a->in[i].a = a;
+		a->in[i].t = libusb_alloc_transfer(0);
+		a->in[i].buf = malloc(ASYNC_CHUNK);
+
+		if (!a->out[i].t || !a->in[i].t || !a->in[i].buf) {
+			jtagkey_async_close(a, ftdic);
+			return NULL;
+		}
+	}
+
+	DPRINTF("FTDI async transport on interface %d, endpoints %02x/%02x, %d byte packets\n",
+			a->iface, a->out_ep, a->in_ep, a->packet);
+
+	return a;
+}
+
+/* Give the endpoints back to libftdi */
+void jtagkey_async_close(struct jtagkey_async *a, struct ftdi_context *ftdic) {
+	int i;
+
+	for (i = 0; i < ASYNC_URBS; i++) {
+		if (a->out[i].t)
+			libusb_free_transfer(a->out[i].t);
+		if (a->in[i].t)
+			libusb_free_transfer(a->in[i].t);
+		free(a->in[i].buf);
+	}
+
+	libusb_release_interface(a->dev, a->iface);
+	libusb_close(a->dev);
+	libusb_exit(a->ctx);
+	free(a);
+
+	usb_claim_interface(ftdic->usb_dev, ftdic->interface);
+}
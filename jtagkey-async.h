@@ -0,0 +1,5 @@
+struct jtagkey_async;
+
+struct jtagkey_async __attribute__ ((visibility ("hidden"))) *jtagkey_async_open(struct ftdi_context *ftdic);
+void __attribute__ ((visibility ("hidden"))) jtagkey_async_close(struct jtagkey_async *a, struct ftdi_context *ftdic);
+int __attribute__ ((visibility ("hidden"))) jtagkey_async_xfer(struct jtagkey_async *a, unsigned char *wbuf, int wlen, unsigned char *rbuf, int rlen);
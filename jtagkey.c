@@ -1,128 +1,1523 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <ftdi.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <inttypes.h>
+#include <sys/time.h>
 #include "usb-driver.h"
 #include "config.h"
 #include "jtagkey.h"
 #include "jtagmon.h"
+#ifdef JTAGKEY_ASYNC
+#include "jtagkey-async.h"
+#endif
 
+/* Largest combined write */
 #define USBBUFSIZE 1048576
+/* Transfer size libftdi uses, it keeps a read buffer of this size */
+#define FTDI_CHUNKSIZE 65536
+/* Baud rate in bit-bang mode, the pins change at BITBANG_RATE times it */
 #define JTAG_SPEED 100000
+#define BITBANG_RATE 16
 #define BULK_LATENCY 2
 #define OTHER_LATENCY 1
+/* Write-only flushes from this size on use asynchronous bit-bang */
+#define ASYNC_MIN 4096
+/* Modem status polls while waiting for the chip to send out its buffer */
+#define ASYNC_DRAIN_POLLS 1000
+
+/* TCK frequency in MPSSE mode */
+#define MPSSE_SPEED 1000000
+/* Maximum number of bits collected in one MPSSE data shift */
+#define MPSSE_RUNBYTES 4096
+
+/* Initial size of the pin state buffers, flushes between checks if they can shrink */
+#define POOL_MIN 4096
+#define POOL_TRIM 256
+
+/* Translation cache: slots, and the longest batch (in transfers) cached */
+#define XCACHE_SLOTS 16
+#define XCACHE_MAX 256
+/* Start state plus port, command and data of every transfer */
+#define XCACHE_KEYLEN(num) (2 + 3 * (num))
+/* Base clock of the MPSSE TCK divisor, H-series chips without divide by 5 */
+#define MPSSE_CLOCK 6000000
+#define MPSSE_CLOCK_H 30000000
+
+/* speed=auto: bits shifted through the DR chain, enough for 16 IDCODEs */
+#define AUTOTUNE_CHAIN 512
+#define AUTOTUNE_PATTERN 128
+#define AUTOTUNE_TRIES 3
+#define AUTOTUNE_CACHE ".libusb-driver-speeds"
+
+/* Flush statistics are weighted with 1/2^CTRL_SHIFT */
+#define CTRL_SHIFT 4
+/* Switch latency when more/less than this share (of 256) of flushes read */
+#define CTRL_INTERACTIVE 192
+#define CTRL_BULK 64
+/* Flush early once the fixed cost of a flush is below 1/CTRL_AMORTIZE */
+#define CTRL_AMORTIZE 8
+#define CTRL_MIN_FLUSH 4096
+
+/* hCard of an opened port */
+#define JTAGKEY_HANDLE(num) (0x100 + (num))
+
+/*
+ * Latency timer and flush control. Every flush updates a moving average
+ * of how many flushes wait for reads and of what a flush costs. The
+ * latency timer only follows the session when the read share crosses a
+ * threshold, and the write-combining buffer is flushed as soon as it is
+ * big enough that the per-flush overhead no longer matters.
+ */
+struct jtagkey_ctrl_s {
+	int latency;		/* current latency timer, 0 if unknown */
+	int read_share;		/* flushes with reads, out of 256 */
+	long fixed_us;		/* cost of a flush independent of its size */
+	long byte_ns;		/* cost per byte */
+	int flush_threshold;
+	/* counters */
+	unsigned long flushes;
+	unsigned long read_flushes;
+	unsigned long early_flushes;
+	unsigned long latency_switches;
+	unsigned long long bytes;
+	unsigned long long busy_us;
+};
+
+/*
+ * Reader thread, started once per opened device. The chip only accepts
+ * more data when its answers are drained, so reading has to run in
+ * parallel to ftdi_write_data. The thread sleeps until a request is
+ * submitted and signals its completion.
+ */
+struct jtagkey_reader_s {
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	int		running;
+	int		stop;
+	int		cancel;	/* the write failed, the data will never come */
+	unsigned char	*buf;
+	int		num;	/* bytes still to be read */
+	int		ret;	/* 0 or the first error from libftdi */
+};
+
+/*
+ * MPSSE engine
+ *
+ * The pin states impact writes through the parallel port emulation are
+ * turned into MPSSE commands: every rising edge of TCK becomes one clock
+ * of a data shift (TMS constant) or of a TMS shift (TDI constant). TDO is
+ * only sampled for clocks which have a status read attached to them, so the
+ * chip only returns the bits impact actually looks at.
+ */
+
+struct mpsse_read {
+	int pos;	/* position in readbuf */
+	int byte;	/* byte in MPSSE response, -1 while still pending */
+	int bit;	/* bit in that byte, -1 for a GET_BITS_LOW byte */
+};
+
+#define MPSSE_HELD	-2	/* TDO already known, value in bit */
+
+struct mpsse_s {
+	unsigned char *cmd;
+	int cmdlen;
+	int cmdsize;
+	int rdlen;
+	int err;
+	unsigned char state;	/* last pin state seen in the stream */
+	unsigned char tms;	/* level of TMS after the queued clocks */
+	unsigned char dir;	/* direction of the low byte pins */
+	/* clocks not yet converted to a command */
+	unsigned char run[MPSSE_RUNBYTES];
+	int nbits;
+	int tmsrun;		/* clock out via TMS command */
+	unsigned char tmsrun_tdi;
+	int run_reads;		/* index of first read attached to the run */
+	int lastclk;		/* bit of the last clock in run, -1 if none */
+	int held;		/* TDO of the last clock while TCK is high, -1 if unknown */
+	int held_read;		/* read which will deliver held */
+	struct mpsse_read *reads;
+	int nreads;
+	int maxreads;
+	unsigned char *resp;
+	int respsize;
+};
+
+/* Status port read, answered after the pin states have been sent */
+struct jtagkey_status_read {
+	int		elem;		/* index in the WD_TRANSFER array */
+	int		pos;		/* position of the read in writebuf */
+	unsigned char	last_write;	/* data port value at the time of the read */
+};
+
+/*
+ * A translated batch with reads. Polling loops send the same batches over
+ * and over, a hit replaces the translation by a few copies.
+ */
+struct jtagkey_xcache_entry {
+	uint32_t hash;
+	int num;			/* transfers, 0 if the slot is free */
+	unsigned char key[XCACHE_KEYLEN(XCACHE_MAX)];
+	unsigned char pins[XCACHE_MAX];
+	int npins;
+	int rpos[XCACHE_MAX];
+	int nr;
+	struct jtagkey_status_read sread[XCACHE_MAX];
+	int nsread;
+	unsigned char last_data;	/* state after the batch */
+	unsigned char last_write;
+};
+
+struct jtagkey_xcache_s {
+	struct jtagkey_xcache_entry *slots;	/* allocated on first use */
+	unsigned char key[XCACHE_KEYLEN(XCACHE_MAX)];
+	int keylen;
+	uint32_t hash;
+	unsigned long lookups;
+	unsigned long hits;
+};
+
+/*
+ * One opened FTDI channel. Every emulated parallel port (and the Platform
+ * Cable USB) gets its own, so both channels of a dual chip can be used at
+ * the same time.
+ */
+struct jtagkey_dev {
+	struct ftdi_context ftdic;
+	int ftdi_inited, ftdi_opened;	/* what jtagkey_dev_free has to undo */
+	int mpsse;
+	int hispeed;
+	unsigned char bitbang_mode;
+	unsigned long mpsse_base;
+	/* Cable wiring, data port value -> pins, and the pins driven by us */
+	struct jtagkey_layout layout;
+	unsigned char pp2pins[16];
+	unsigned char pins2status[256];	/* sampled pins -> status port bits */
+	unsigned char pin_dir;
+	unsigned char oe_on, oe_off;
+	struct jtagkey_ctrl_s ctrl;
+	struct jtagkey_reader_s reader;
+	struct mpsse_s mpsse_s;
+#ifdef JTAGKEY_ASYNC
+	struct jtagkey_async *async;	/* queued libusb-1.0 transfers, if enabled */
+#endif
+	/* parallel port emulation state */
+	unsigned char last_data;
+	unsigned char last_write;
+	unsigned char *writebuf, *writepos;
+	unsigned char *readbuf;
+	int bufsize;			/* size of writebuf and readbuf */
+	int bufpeak;			/* largest flush since the last trim */
+	int buftrim;			/* flushes until the next trim */
+	int *rpos, maxrpos;
+	struct jtagkey_status_read *sread;
+	struct jtagkey_xcache_s xcache;
+};
+
+/* Devices by parallel port number, and the one used as Platform Cable USB */
+static struct jtagkey_dev *devs[CONFIG_MAX_PORTS];
+static struct jtagkey_dev *xpcu_dev;
+static int xpcu_refs;		/* XPCU devices using it, the callers serialise */
+
+static int jtagkey_latency(struct jtagkey_dev *jk, int latency) {
+	int ret = 0;
+
+	if (jk->ctrl.latency != latency) {
+		DPRINTF("switching latency\n");
+		if ((ret = ftdi_set_latency_timer(&jk->ftdic, latency))  != 0) {
+			fprintf(stderr, "unable to set latency timer: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
+			return ret;
+		}
+		
+		if (jk->ctrl.latency)
+			jk->ctrl.latency_switches++;
+		jk->ctrl.latency = latency;
+	}
+
+	return ret;
+}
+
+static void jtagkey_ctrl_init(struct jtagkey_dev *jk) {
+	memset(&jk->ctrl, 0, sizeof(jk->ctrl));
+	jk->ctrl.read_share = 256;
+	jk->ctrl.flush_threshold = USBBUFSIZE;
+}
+
+/* Called before each flush, returns the time the flush started */
+static void jtagkey_ctrl_begin(struct jtagkey_dev *jk, int reads, struct timeval *start) {
+	jk->ctrl.read_share += ((reads ? 256 : 0) - jk->ctrl.read_share) >> CTRL_SHIFT;
+
+	/* MPSSE reads end with SEND_IMMEDIATE, the latency timer doesn't matter */
+	if (!jk->mpsse) {
+		if (jk->ctrl.read_share > CTRL_INTERACTIVE)
+			jtagkey_latency(jk, OTHER_LATENCY);
+		else if (jk->ctrl.read_share < CTRL_BULK)
+			jtagkey_latency(jk, BULK_LATENCY);
+	}
+
+	gettimeofday(start, NULL);
+}
+
+static void jtagkey_ctrl_end(struct jtagkey_dev *jk, int reads, int len, struct timeval *start) {
+	struct timeval now;
+	long us;
+
+	gettimeofday(&now, NULL);
+	us = (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_usec - start->tv_usec);
+
+	jk->ctrl.flushes++;
+	if (reads)
+		jk->ctrl.read_flushes++;
+	jk->ctrl.bytes += len;
+	jk->ctrl.busy_us += us;
+
+	/* small flushes show the fixed cost, big ones the cost per byte */
+	if (len <= 64) {
+		jk->ctrl.fixed_us += (us - jk->ctrl.fixed_us) >> CTRL_SHIFT;
+	} else if (len >= CTRL_MIN_FLUSH && us > jk->ctrl.fixed_us) {
+		long ns = ((us - jk->ctrl.fixed_us) * 1000) / len;
+
+		jk->ctrl.byte_ns += (ns - jk->ctrl.byte_ns) >> CTRL_SHIFT;
+	}
+
+	if (jk->ctrl.fixed_us && jk->ctrl.byte_ns) {
+		long threshold = (jk->ctrl.fixed_us * 1000 * CTRL_AMORTIZE) / jk->ctrl.byte_ns;
+
+		if (threshold < CTRL_MIN_FLUSH)
+			threshold = CTRL_MIN_FLUSH;
+		if (threshold > USBBUFSIZE)
+			threshold = USBBUFSIZE;
+
+		jk->ctrl.flush_threshold = threshold;
+	}
+}
+
+static void jtagkey_ctrl_stats(struct jtagkey_dev *jk) {
+	if (!getenv("JTAGKEY_STATS"))
+		return;
+
+	fprintf(stderr, "jtagkey: %lu flushes (%lu with reads, %lu early), %llu bytes in %llu us\n",
+			jk->ctrl.flushes, jk->ctrl.read_flushes, jk->ctrl.early_flushes,
+			jk->ctrl.bytes, jk->ctrl.busy_us);
+	fprintf(stderr, "jtagkey: latency %d ms, %lu switches, read share %d/256\n",
+			jk->ctrl.latency, jk->ctrl.latency_switches, jk->ctrl.read_share);
+	fprintf(stderr, "jtagkey: flush cost %ld us + %ld ns/byte, threshold %d bytes\n",
+			jk->ctrl.fixed_us, jk->ctrl.byte_ns, jk->ctrl.flush_threshold);
+	fprintf(stderr, "jtagkey: translation cache %lu hits in %lu lookups\n",
+			jk->xcache.hits, jk->xcache.lookups);
+}
+
+static void *jtagkey_reader(void *thread_arg) {
+	struct jtagkey_dev *jk = (struct jtagkey_dev*)thread_arg;
+	struct jtagkey_reader_s *r = &jk->reader;
+	unsigned char *buf;
+	int num, ret;
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->stop) {
+		if (!r->num) {
+			pthread_cond_wait(&r->cond, &r->lock);
+			continue;
+		}
+
+		buf = r->buf;
+		num = r->num;
+		pthread_mutex_unlock(&r->lock);
+
+		DPRINTF("reader for %d bytes\n", num);
+		ret = 0;
+		while (num > 0 && !__atomic_load_n(&r->cancel, __ATOMIC_RELAXED)) {
+			/* blocks in libusb until the latency timer expires */
+			ret = ftdi_read_data(&jk->ftdic, buf, num);
+			if (ret < 0) {
+				fprintf(stderr, "unable to read data: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
+				break;
+			}
+
+			buf += ret;
+			num -= ret;
+		}
+
+		pthread_mutex_lock(&r->lock);
+		r->ret = (ret < 0) ? ret : 0;
+		r->num = 0;
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+static int jtagkey_reader_start(struct jtagkey_dev *jk) {
+	int ret;
+
+	if (jk->reader.running)
+		return 0;
+
+	jk->reader.stop = 0;
+	jk->reader.num = 0;
+	pthread_mutex_init(&jk->reader.lock, NULL);
+	pthread_cond_init(&jk->reader.cond, NULL);
+
+	if ((ret = pthread_create(&jk->reader.thread, NULL, &jtagkey_reader, jk)) != 0) {
+		fprintf(stderr, "unable to start reader thread: %d\n", ret);
+		pthread_cond_destroy(&jk->reader.cond);
+		pthread_mutex_destroy(&jk->reader.lock);
+		return -ret;
+	}
+
+	jk->reader.running = 1;
+
+	return 0;
+}
+
+static void jtagkey_reader_stop(struct jtagkey_dev *jk) {
+	if (!jk->reader.running)
+		return;
+
+	pthread_mutex_lock(&jk->reader.lock);
+	jk->reader.stop = 1;
+	pthread_cond_broadcast(&jk->reader.cond);
+	pthread_mutex_unlock(&jk->reader.lock);
+
+	pthread_join(jk->reader.thread, NULL);
+	pthread_cond_destroy(&jk->reader.cond);
+	pthread_mutex_destroy(&jk->reader.lock);
+	jk->reader.running = 0;
+}
+
+/* Hand num bytes to the reader thread, to be stored at buf */
+static void jtagkey_reader_submit(struct jtagkey_dev *jk, unsigned char *buf, int num) {
+	pthread_mutex_lock(&jk->reader.lock);
+	jk->reader.buf = buf;
+	jk->reader.num = num;
+	jk->reader.ret = 0;
+	jk->reader.cancel = 0;
+	pthread_cond_broadcast(&jk->reader.cond);
+	pthread_mutex_unlock(&jk->reader.lock);
+}
+
+static int jtagkey_reader_wait(struct jtagkey_dev *jk) {
+	int ret;
+
+	pthread_mutex_lock(&jk->reader.lock);
+	while (jk->reader.num)
+		pthread_cond_wait(&jk->reader.cond, &jk->reader.lock);
+	ret = jk->reader.ret;
+	pthread_mutex_unlock(&jk->reader.lock);
+
+	return ret;
+}
+
+/* Send len bytes and store the first rlen bytes the chip answers in rbuf */
+static int jtagkey_xfer(struct jtagkey_dev *jk, unsigned char *buf, int len, unsigned char *rbuf, int rlen) {
+	int ret;
+
+#ifdef JTAGKEY_ASYNC
+	if (jk->async)
+		return jtagkey_async_xfer(jk->async, buf, len, rbuf, rlen);
+#endif
+
+	if (rlen)
+		jtagkey_reader_submit(jk, rbuf, rlen);
+
+	if ((ret = ftdi_write_data(&jk->ftdic, buf, len)) < 0) {
+		fprintf(stderr, "unable to write data: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
+
+		/* the reader gives up after the read it is in */
+		if (rlen) {
+			__atomic_store_n(&jk->reader.cancel, 1, __ATOMIC_RELAXED);
+			jtagkey_reader_wait(jk);
+		}
+
+		return ret;
+	}
+
+	if (rlen) {
+		int err = jtagkey_reader_wait(jk);
+
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static unsigned char *mpsse_grow(struct mpsse_s *m, int len) {
+	unsigned char *pos;
+
+	if (m->cmdlen + len > m->cmdsize) {
+		int size = m->cmdsize ? m->cmdsize : 4096;
+		unsigned char *cmd;
+
+		while (size < m->cmdlen + len)
+			size *= 2;
+
+		cmd = realloc(m->cmd, size);
+		if (!cmd) {
+			m->err = -ENOMEM;
+			m->cmdlen = 0;
+			return NULL;
+		}
+
+		m->cmd = cmd;
+		m->cmdsize = size;
+	}
+
+	pos = m->cmd + m->cmdlen;
+	m->cmdlen += len;
+
+	return pos;
+}
+
+static void mpsse_add_read(struct mpsse_s *m, int pos, int byte, int bit) {
+	if (m->nreads == m->maxreads) {
+		int max = m->maxreads ? m->maxreads * 2 : 256;
+		struct mpsse_read *reads;
+
+		reads = realloc(m->reads, max * sizeof(struct mpsse_read));
+		if (!reads) {
+			m->err = -ENOMEM;
+			return;
+		}
+
+		m->reads = reads;
+		m->maxreads = max;
+	}
+
+	m->reads[m->nreads].pos = pos;
+	m->reads[m->nreads].byte = byte;
+	m->reads[m->nreads].bit = bit;
+	m->nreads++;
+}
+
+static void mpsse_flush_run(struct mpsse_s *m) {
+	unsigned char *cmd;
+	unsigned char op;
+	int rd = (m->run_reads < m->nreads);
+	int full, rem, i;
+
+	if (!m->nbits)
+		return;
+
+	op = MPSSE_WRITE_NEG | MPSSE_LSB;
+	if (rd)
+		op |= MPSSE_DO_READ;
+
+	if (m->tmsrun) {
+		/* TMS shift, up to 7 bits with TDI held in bit 7 */
+		if ((cmd = mpsse_grow(m, 3))) {
+			cmd[0] = op | MPSSE_WRITE_TMS | MPSSE_BITMODE;
+			cmd[1] = m->nbits - 1;
+			cmd[2] = m->run[0] | (m->tmsrun_tdi ? 0x80 : 0x00);
+		}
+
+		for (i = m->run_reads; i < m->nreads; i++) {
+			m->reads[i].bit += 8 - m->nbits;
+			m->reads[i].byte = m->rdlen;
+		}
+
+		if (rd)
+			m->rdlen++;
+	} else {
+		full = m->nbits / 8;
+		rem = m->nbits % 8;
+
+		op |= MPSSE_DO_WRITE;
+		if (full && (cmd = mpsse_grow(m, 3 + full))) {
+			cmd[0] = op;
+			cmd[1] = (full - 1) & 0xff;
+			cmd[2] = ((full - 1) >> 8) & 0xff;
+			memcpy(cmd + 3, m->run, full);
+		}
+
+		if (rem && (cmd = mpsse_grow(m, 3))) {
+			cmd[0] = op | MPSSE_BITMODE;
+			cmd[1] = rem - 1;
+			cmd[2] = m->run[full];
+		}
+
+		/* Bit shifts return their bits in the top of the byte */
+		for (i = m->run_reads; i < m->nreads; i++) {
+			int bit = m->reads[i].bit;
+
+			if (bit < full * 8) {
+				m->reads[i].byte = m->rdlen + bit / 8;
+				m->reads[i].bit = bit % 8;
+			} else {
+				m->reads[i].byte = m->rdlen + full;
+				m->reads[i].bit = (8 - rem) + (bit - full * 8);
+			}
+		}
+
+		if (rd)
+			m->rdlen += full + (rem ? 1 : 0);
+	}
+
+	m->nbits = 0;
+	m->tmsrun = 0;
+	m->lastclk = -1;
+	m->run_reads = m->nreads;
+}
+
+static void mpsse_clock(struct mpsse_s *m, unsigned char tms, unsigned char tdi, int pos) {
+	if (m->nbits && m->tmsrun && ((m->tmsrun_tdi != tdi) || (m->nbits == 7)))
+		mpsse_flush_run(m);
+
+	if (!m->nbits || !m->tmsrun) {
+		if (tms == m->tms) {
+			/* TMS already has the right level, shift TDI */
+			if (m->nbits == MPSSE_RUNBYTES * 8)
+				mpsse_flush_run(m);
+		} else {
+			mpsse_flush_run(m);
+			m->tmsrun = 1;
+			m->tmsrun_tdi = tdi;
+		}
+	}
+
+	if (!(m->nbits % 8))
+		m->run[m->nbits / 8] = 0x00;
+
+	if (m->tmsrun ? tms : tdi)
+		m->run[m->nbits / 8] |= 1 << (m->nbits % 8);
+
+	m->lastclk = m->nbits;
+	m->nbits++;
+	m->tms = tms;
+	m->held = -1;
+
+	if (pos >= 0)
+		mpsse_add_read(m, pos, -1, m->lastclk);
+}
+
+static void mpsse_get_bits(struct mpsse_s *m, int pos) {
+	unsigned char *cmd;
+
+	mpsse_flush_run(m);
+
+	if ((cmd = mpsse_grow(m, 1)))
+		cmd[0] = GET_BITS_LOW;
+
+	mpsse_add_read(m, pos, m->rdlen, -1);
+	m->run_reads = m->nreads;
+	m->rdlen++;
+}
+
+static void mpsse_set_bits(struct mpsse_s *m, unsigned char value) {
+	unsigned char *cmd;
+
+	mpsse_flush_run(m);
+
+	if ((cmd = mpsse_grow(m, 3))) {
+		cmd[0] = SET_BITS_LOW;
+		cmd[1] = value & ~JTAGKEY_TCK;
+		cmd[2] = m->dir;
+	}
+
+	m->tms = (value & JTAGKEY_TMS) ? 1 : 0;
+	m->held = -1;
+}
+
+/* Read the TDO value sampled by the last clock, or the pins if there is none */
+static void mpsse_read_last(struct mpsse_s *m, int pos) {
+	if (m->lastclk >= 0)
+		mpsse_add_read(m, pos, -1, m->lastclk);
+	else if (m->held >= 0) {
+		mpsse_add_read(m, pos, MPSSE_HELD, m->held);
+		m->run_reads = m->nreads;
+	} else
+		mpsse_get_bits(m, pos);
+}
+
+/*
+ * MPSSE clocks always end with TCK low, so a clock whose falling edge is
+ * still outstanding in the pin stream is kept back until the next transfer.
+ * Reads of TDO while TCK is high then still see the right value.
+ */
+static void mpsse_flush_held(struct mpsse_s *m) {
+	unsigned char bit;
+	int tmsrun, tdi;
+	int i;
+
+	if (!(m->state & JTAGKEY_TCK) || (m->lastclk < 0)) {
+		mpsse_flush_run(m);
+		return;
+	}
+
+	for (i = m->run_reads; i < m->nreads; i++) {
+		if ((m->reads[i].byte < 0) && (m->reads[i].bit == m->lastclk)) {
+			/* TDO of the last clock is read now anyway */
+			mpsse_flush_run(m);
+			m->held_read = i;
+			return;
+		}
+	}
+
+	bit = (m->run[m->lastclk / 8] >> (m->lastclk % 8)) & 1;
+	tmsrun = m->tmsrun;
+	tdi = m->tmsrun_tdi;
+
+	m->nbits--;
+	mpsse_flush_run(m);
+
+	m->tmsrun = tmsrun;
+	m->tmsrun_tdi = tdi;
+	m->run[0] = bit;
+	m->nbits = 1;
+	m->lastclk = 0;
+}
+
+/*
+ * Convert the pin states in buf to MPSSE commands. rpos holds the positions
+ * of status reads in buf, their results are stored at readbuf[rpos[i]+1]
+ * just like the synchronous bit-bang mode would deliver them.
+ */
+static void mpsse_encode(struct mpsse_s *m, unsigned char *buf, int len, int *rpos, int nr) {
+	const unsigned char jtag = JTAGKEY_TCK|JTAGKEY_TDI|JTAGKEY_TMS;
+	unsigned char data;
+	int pending = 0;
+	int i, j, k = 0;
+
+	for (i = 0; i < len; i++) {
+		data = buf[i];
+
+		if ((k < nr) && (rpos[k] == i)) {
+			k++;
+			if (m->state & JTAGKEY_TCK) {
+				/* TDO does not change before the falling edge */
+				mpsse_read_last(m, i + 1);
+			} else {
+				/* TDO will be sampled on the next rising edge */
+				pending++;
+			}
+			continue;
+		}
+
+		if ((data & ~jtag) != (m->state & ~jtag)) {
+			for (j = k - pending; j < k; j++)
+				mpsse_get_bits(m, rpos[j] + 1);
+			pending = 0;
+
+			mpsse_set_bits(m, data);
+		}
+
+		if (!(m->state & JTAGKEY_TCK) && (data & JTAGKEY_TCK)) {
+			mpsse_clock(m, (data & JTAGKEY_TMS) ? 1 : 0,
+					(data & JTAGKEY_TDI) ? 1 : 0,
+					pending ? rpos[k - pending] + 1 : -1);
+
+			for (j = k - pending + 1; j < k; j++)
+				mpsse_read_last(m, rpos[j] + 1);
+			pending = 0;
+		}
+
+		m->state = data;
+	}
+
+	for (j = k - pending; j < k; j++)
+		mpsse_get_bits(m, rpos[j] + 1);
+
+	mpsse_flush_held(m);
+}
+
+static void mpsse_begin(struct mpsse_s *m) {
+	m->cmdlen = 0;
+	m->rdlen = 0;
+	m->nreads = 0;
+	m->run_reads = 0;
+	m->held_read = -1;
+	m->err = 0;
+}
+
+/* Send the queued commands and distribute the response to readbuf */
+static int mpsse_execute(struct jtagkey_dev *jk, unsigned char *readbuf) {
+	struct mpsse_s *m = &jk->mpsse_s;
+	unsigned char *cmd;
+	int ret = 0;
+	int i;
+
+	if (m->rdlen && (cmd = mpsse_grow(m, 1)))
+		cmd[0] = SEND_IMMEDIATE;
+
+	if (!m->err && m->rdlen > m->respsize) {
+		unsigned char *resp = realloc(m->resp, m->rdlen);
+
+		if (resp) {
+			m->resp = resp;
+			m->respsize = m->rdlen;
+		} else {
+			m->err = -ENOMEM;
+		}
+	}
+
+	if (m->err) {
+		fprintf(stderr, "unable to encode MPSSE commands: %d\n", m->err);
+		return m->err;
+	}
+
+	DPRINTF("MPSSE: %d bytes of commands, %d bytes response\n", m->cmdlen, m->rdlen);
+
+	if ((ret = jtagkey_xfer(jk, m->cmd, m->cmdlen, m->resp, m->rdlen)) < 0)
+		return ret;
+
+	if (m->rdlen) {
+		for (i = 0; i < m->nreads; i++) {
+			struct mpsse_read *r = &(m->reads[i]);
+
+			if (r->byte == MPSSE_HELD)
+				readbuf[r->pos] = r->bit ? JTAGKEY_TDO : 0x00;
+			else if (r->bit < 0)
+				readbuf[r->pos] = m->resp[r->byte];
+			else
+				readbuf[r->pos] = ((m->resp[r->byte] >> r->bit) & 1) ? JTAGKEY_TDO : 0x00;
+		}
+
+		if (m->held_read >= 0)
+			m->held = (readbuf[m->reads[m->held_read].pos] & JTAGKEY_TDO) ? 1 : 0;
+	}
+
+	return 0;
+}
+
+static int jtagkey_mpsse_xfer(struct jtagkey_dev *jk, unsigned char *buf, int len, unsigned char *readbuf, int *rpos, int nr) {
+	struct mpsse_s *m = &jk->mpsse_s;
+
+	mpsse_begin(m);
+	mpsse_encode(m, buf, len, rpos, nr);
+
+	return mpsse_execute(jk, readbuf);
+}
+
+static int jtagkey_mpsse_speed(struct jtagkey_dev *jk, unsigned long speed) {
+	unsigned char buf[3];
+	int div;
+	int ret;
+
+	/* round the divisor up, TCK must not exceed the requested speed */
+	div = ((jk->mpsse_base + speed - 1) / speed) - 1;
+	if (div < 0)
+		div = 0;
+	if (div > 0xffff)
+		div = 0xffff;
+
+	DPRINTF("MPSSE: TCK %lu Hz\n", jk->mpsse_base / (div + 1));
+
+	buf[0] = TCK_DIVISOR;
+	buf[1] = div & 0xff;
+	buf[2] = (div >> 8) & 0xff;
+
+	if ((ret = ftdi_write_data(&jk->ftdic, buf, 3)) != 3) {
+		fprintf(stderr, "unable to set TCK divisor: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int jtagkey_mpsse_init(struct jtagkey_dev *jk, unsigned long speed, unsigned int flags) {
+	unsigned char buf[16];
+	int len = 0;
+	int ret;
+
+	if ((ret = ftdi_set_bitmode(&jk->ftdic, 0x00, BITMODE_RESET))  != 0) {
+		fprintf(stderr, "unable to reset bitmode: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
+		return ret;
+	}
+
+	if ((ret = ftdi_set_bitmode(&jk->ftdic, 0x00, BITMODE_MPSSE))  != 0) {
+		fprintf(stderr, "unable to enable MPSSE mode: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
+		return ret;
+	}
+
+	if ((ret = ftdi_usb_purge_buffers(&jk->ftdic))  != 0) {
+		fprintf(stderr, "unable to purge buffers: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
+		return ret;
+	}
+
+	buf[len++] = LOOPBACK_END;
+	buf[len++] = SET_BITS_LOW;
+	buf[len++] = jk->oe_on;
+	buf[len++] = jk->pin_dir;
+
+	if (jk->layout.high_dir) {
+		buf[len++] = SET_BITS_HIGH;
+		buf[len++] = jk->layout.high_value;
+		buf[len++] = jk->layout.high_dir;
+	}
+
+	if (jk->hispeed) {
+		/* 60 MHz master clock, TCK on the rising and falling edge only */
+		buf[len++] = DIS_DIV_5;
+		buf[len++] = DIS_3_PHASE;
+		/* wait for RTCK on GPIOL3 before every clock */
+		buf[len++] = (flags & CONFIG_FLAG_RTCK) ? EN_ADAPTIVE : DIS_ADAPTIVE;
+		jk->mpsse_base = MPSSE_CLOCK_H;
+	} else {
+		if (flags & CONFIG_FLAG_RTCK)
+			fprintf(stderr, "rtck needs an FT2232H, FT4232H or FT232H, ignored\n");
+		jk->mpsse_base = MPSSE_CLOCK;
+	}
+
+	if ((ret = ftdi_write_data(&jk->ftdic, buf, len)) != len) {
+		fprintf(stderr, "unable to initialise MPSSE: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
+		return -1;
+	}
+
+	if ((ret = jtagkey_mpsse_speed(jk, speed)) != 0)
+		return ret;
+
+	jk->mpsse_s.dir = jk->pin_dir;
+	jk->mpsse_s.state = 0x00;
+	jk->mpsse_s.tms = 0;
+	jk->mpsse_s.nbits = 0;
+	jk->mpsse_s.lastclk = -1;
+	jk->mpsse_s.held = -1;
+
+	return 0;
+}
+
+/*
+ * speed=auto: shift a pattern through the DR chain after a TAP reset
+ * (IDCODE or BYPASS registers, so nothing on the board changes) at
+ * increasing frequencies. The highest frequency which still gives the
+ * same result as the slowest one is cached per cable in
+ * ~/.libusb-driver-speeds.
+ */
+static const unsigned long autotune_speeds[] = {
+	100000, 500000, 1000000, 1500000, 2000000, 3000000, 6000000,
+	10000000, 15000000, 30000000, 0
+};
+
+static void jtagkey_autotune_key(struct jtagkey_dev *jk, char *key, int len, unsigned short vid, unsigned short pid) {
+	struct usb_device *dev = usb_device(jk->ftdic.usb_dev);
+
+	if (!dev || !dev->descriptor.iSerialNumber ||
+			usb_get_string_simple(jk->ftdic.usb_dev, dev->descriptor.iSerialNumber, key, len) <= 0)
+		snprintf(key, len, "%04x:%04x", vid, pid);
+}
+
+static unsigned long jtagkey_autotune_cached(char *key) {
+	char buf[256], name[128];
+	unsigned long speed, ret = 0;
+	FILE *cache;
+
+	snprintf(buf, sizeof(buf), "%s/" AUTOTUNE_CACHE, getenv("HOME"));
+	if (!(cache = fopen(buf, "r")))
+		return 0;
+
+	while (fgets(buf, sizeof(buf), cache)) {
+		if (sscanf(buf, "%127s %lu", name, &speed) == 2 && !strcmp(name, key))
+			ret = speed;
+	}
+
+	fclose(cache);
+
+	return ret;
+}
+
+static void jtagkey_autotune_store(char *key, unsigned long speed) {
+	char buf[256];
+	FILE *cache;
+
+	snprintf(buf, sizeof(buf), "%s/" AUTOTUNE_CACHE, getenv("HOME"));
+	if (!(cache = fopen(buf, "a")))
+		return;
+
+	/* later entries win when reading */
+	fprintf(cache, "%s %lu\n", key, speed);
+	fclose(cache);
+}
+
+static int jtagkey_dev_shift(struct jtagkey_dev *jk, unsigned char *clk, int len, unsigned char *tdo);
+
+/* One pass through the chain, the sampled TDO bits are stored in out */
+static int jtagkey_autotune_shift(struct jtagkey_dev *jk, unsigned char *out) {
+	/* Test-Logic-Reset -> Run-Test/Idle -> Shift-DR */
+	static const unsigned char enter[] = { 1, 1, 1, 1, 1, 0, 1, 0, 0 };
+	const int nbits = AUTOTUNE_CHAIN + AUTOTUNE_PATTERN;
+	unsigned char clk[sizeof(enter) + AUTOTUNE_CHAIN + AUTOTUNE_PATTERN + 5];
+	unsigned char tdo[sizeof(clk)];
+	unsigned int lfsr = 0xace1;
+	int i, n = 0;
+	int ret;
+
+	for (i = 0; i < sizeof(enter); i++)
+		clk[n++] = enter[i] ? JTAGKEY_TMS : 0x00;
+
+	for (i = 0; i < nbits; i++) {
+		lfsr = (lfsr >> 1) ^ (-(lfsr & 1) & 0xb400);
+		clk[n] = JTAGKEY_TDO | ((lfsr & 1) ? JTAGKEY_TDI : 0x00);
+		/* leave Shift-DR with the last bit */
+		if (i == nbits - 1)
+			clk[n] |= JTAGKEY_TMS;
+		n++;
+	}
+
+	/* back to Test-Logic-Reset */
+	for (i = 0; i < 5; i++)
+		clk[n++] = JTAGKEY_TMS;
+
+	if ((ret = jtagkey_dev_shift(jk, clk, n, tdo)) < 0)
+		return ret;
+
+	for (i = 0; i < nbits; i++)
+		out[i] = (tdo[sizeof(enter) + i] & JTAGKEY_TDO) ? 1 : 0;
+
+	/* the pattern must come out after the chain for the result to mean anything */
+	for (n = 1; n <= AUTOTUNE_CHAIN; n++) {
+		for (i = 0; i < AUTOTUNE_PATTERN; i++) {
+			if (out[n + i] != ((clk[sizeof(enter) + i] & JTAGKEY_TDI) ? 1 : 0))
+				break;
+		}
+
+		if (i == AUTOTUNE_PATTERN)
+			return 0;
+	}
+
+	return -EIO;
+}
+
+static unsigned long jtagkey_autotune(struct jtagkey_dev *jk, unsigned short vid, unsigned short pid) {
+	unsigned char ref[AUTOTUNE_CHAIN + AUTOTUNE_PATTERN];
+	unsigned char out[AUTOTUNE_CHAIN + AUTOTUNE_PATTERN];
+	unsigned long speed;
+	char key[128];
+	int i, j;
+
+	jtagkey_autotune_key(jk, key, sizeof(key), vid, pid);
+
+	if ((speed = jtagkey_autotune_cached(key))) {
+		DPRINTF("using cached speed %lu for %s\n", speed, key);
+		return speed;
+	}
+
+	/* the reference has to be reproducible at the lowest speed */
+	speed = autotune_speeds[0];
+	if (jtagkey_mpsse_speed(jk, speed) || jtagkey_autotune_shift(jk, out) ||
+			jtagkey_autotune_shift(jk, ref) || memcmp(ref, out, sizeof(ref))) {
+		fprintf(stderr, "JTAG chain on %s not working, unable to tune the speed\n", key);
+		return MPSSE_SPEED;
+	}
+
+	for (i = 1; autotune_speeds[i] && autotune_speeds[i] <= jk->mpsse_base; i++) {
+		if (jtagkey_mpsse_speed(jk, autotune_speeds[i]))
+			break;
+
+		for (j = 0; j < AUTOTUNE_TRIES; j++) {
+			if (jtagkey_autotune_shift(jk, out) || memcmp(ref, out, sizeof(ref)))
+				break;
+		}
+
+		if (j < AUTOTUNE_TRIES)
+			break;
+
+		speed = autotune_speeds[i];
+	}
+
+	fprintf(stderr, "using TCK %lu Hz for %s\n", speed, key);
+	jtagkey_autotune_store(key, speed);
 
-static struct ftdi_context ftdic;
+	return speed;
+}
 
-static int jtagkey_latency(int latency) {
-	static int current = 0;
+/*
+ * Switch between synchronous bit-bang, where every byte written returns
+ * a sample of the pins, and asynchronous bit-bang for long writes of which
+ * nothing has to be read back.
+ */
+static int jtagkey_bitbang_mode(struct jtagkey_dev *jk, unsigned char mode) {
+	unsigned short status = 0;
 	int ret;
+	int i;
 
-	if (current != latency) {
-		DPRINTF("switching latency\n");
-		if ((ret = ftdi_set_latency_timer(&ftdic, latency))  != 0) {
-			fprintf(stderr, "unable to set latency timer: %d (%s)\n", ret, ftdi_get_error_string(&ftdic));
-			return ret;
+	if (jk->bitbang_mode == mode)
+		return 0;
+
+	/* The chip must have sent everything out before the mode changes */
+	for (i = 0; i < ASYNC_DRAIN_POLLS; i++) {
+		if (ftdi_poll_modem_status(&jk->ftdic, &status) < 0)
+			break;
+
+		if (status & 0x4000) /* TEMT */
+			break;
+	}
+
+	if (!(status & 0x4000))
+		fprintf(stderr, "FTDI transmitter not empty before bitbang mode change\n");
+
+	if ((ret = ftdi_set_bitmode(&jk->ftdic, jk->pin_dir, mode))  != 0) {
+		fprintf(stderr, "unable to change bitbang mode: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
+		return ret;
+	}
+
+	/* Samples from the asynchronous mode are of no use */
+	if (mode == BITMODE_SYNCBB)
+		ftdi_usb_purge_rx_buffer(&jk->ftdic);
+
+	jk->bitbang_mode = mode;
+
+	return 0;
+}
+
+/*
+ * Find out which engine the chip has. libftdi 0.x doesn't know all chips,
+ * so the device release number is used.
+ */
+static void jtagkey_chip(struct jtagkey_dev *jk) {
+	struct usb_device *dev = usb_device(jk->ftdic.usb_dev);
+	int bcd = dev ? dev->descriptor.bcdDevice : 0;
+
+	jk->mpsse = 0;
+	jk->hispeed = 0;
+
+	switch(bcd) {
+		case 0x0500:	/* FT2232C/D */
+			jk->mpsse = 1;
+			break;
+
+		case 0x0700:	/* FT2232H */
+		case 0x0800:	/* FT4232H */
+		case 0x0900:	/* FT232H */
+			jk->mpsse = 1;
+			jk->hispeed = 1;
+			break;
+
+		default:
+			switch(jk->ftdic.type) {
+				case TYPE_2232C:
+					jk->mpsse = 1;
+					break;
+
+				case TYPE_2232H:
+				case TYPE_4232H:
+					jk->mpsse = 1;
+					jk->hispeed = 1;
+					break;
+
+				default:
+					break;
+			}
+			break;
+	}
+
+	DPRINTF("FTDI chip release %04x: %s%s\n", bcd, jk->mpsse ? "MPSSE" : "bit-bang",
+			jk->hispeed ? ", high speed" : "");
+}
+
+/* Precompute the data port value -> pin and pin -> status translations for the cable */
+static void jtagkey_layout_init(struct jtagkey_dev *jk, const struct jtagkey_layout *l) {
+	int v, tdo;
+
+	if (!l)
+		l = config_usb_layout(-1);
+
+	jk->layout = *l;
+	jk->oe_on = jk->layout.oe_low ? 0x00 : jk->layout.oe;
+	jk->oe_off = jk->layout.oe_low ? jk->layout.oe : 0x00;
+	jk->pin_dir = jk->layout.tck | jk->layout.tdi | jk->layout.tms | jk->layout.oe;
+
+	for (v = 0; v < 16; v++) {
+		if (v & PP_CTRL) {
+			jk->pp2pins[v] = jk->oe_off;
+			continue;
 		}
-		
-		current = latency;
+
+		jk->pp2pins[v] = jk->oe_on;
+		if (v & PP_TDI)
+			jk->pp2pins[v] |= jk->layout.tdi;
+		if (v & PP_TCK)
+			jk->pp2pins[v] |= jk->layout.tck;
+		if (v & PP_TMS)
+			jk->pp2pins[v] |= jk->layout.tms;
 	}
 
-	return ret;
+	for (v = 0; v < 256; v++) {
+		tdo = (v & jk->layout.tdo) ? 1 : 0;
+		jk->pins2status[v] = (tdo != jk->layout.tdo_low) ? PP_TDO : 0x00;
+	}
+
+	DPRINTF("FTDI layout %s: TCK %02x TDI %02x TDO %02x%s TMS %02x OE %02x%s\n",
+			jk->layout.name, jk->layout.tck, jk->layout.tdi, jk->layout.tdo,
+			jk->layout.tdo_low ? " (inverted)" : "", jk->layout.tms,
+			jk->layout.oe, jk->layout.oe_low ? " (active low)" : "");
 }
 
-static int jtagkey_init(unsigned short vid, unsigned short pid, unsigned short iface) {
+static int jtagkey_init(struct jtagkey_dev *jk, unsigned short vid, unsigned short pid, unsigned short iface, const char *serial, unsigned long speed, unsigned int flags, const struct jtagkey_layout *l) {
 	int ret = 0;
+	int baud;
 	unsigned char c;
 
-	if ((ret = ftdi_init(&ftdic)) != 0) {
-		fprintf(stderr, "unable to initialise libftdi: %d (%s)\n", ret, ftdi_get_error_string(&ftdic));
+	jtagkey_layout_init(jk, l);
+
+	if ((ret = ftdi_init(&jk->ftdic)) != 0) {
+		fprintf(stderr, "unable to initialise libftdi: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
 		return ret;
 	}
+	jk->ftdi_inited = 1;
 	
-	if ((ret = ftdi_set_interface(&ftdic, iface)) != 0) {
-		fprintf(stderr, "unable to set interface: %d (%s)\n", ret, ftdi_get_error_string(&ftdic));
+	if ((ret = ftdi_set_interface(&jk->ftdic, iface)) != 0) {
+		fprintf(stderr, "unable to set interface: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
+		return ret;
+	}
+
+	/* several cables of the same type are told apart by their serial */
+	if ((ret = ftdi_usb_open_desc(&jk->ftdic, vid, pid, NULL, serial)) != 0) {
+		fprintf(stderr, "unable to open ftdi device%s%s: %d (%s)\n", serial ? " " : "", serial ? serial : "",
+				ret, ftdi_get_error_string(&jk->ftdic));
 		return ret;
 	}
+	jk->ftdi_opened = 1;
 
-	if ((ret = ftdi_usb_open(&ftdic, vid, pid)) != 0) {
-		fprintf(stderr, "unable to open ftdi device: %d (%s)\n", ret, ftdi_get_error_string(&ftdic));
+	if ((ret = ftdi_usb_reset(&jk->ftdic)) != 0) {
+		fprintf(stderr, "unable reset device: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
 		return ret;
 	}
 
-	if ((ret = ftdi_usb_reset(&ftdic)) != 0) {
-		fprintf(stderr, "unable reset device: %d (%s)\n", ret, ftdi_get_error_string(&ftdic));
+	if ((ret = ftdi_write_data_set_chunksize(&jk->ftdic, FTDI_CHUNKSIZE))  != 0) {
+		fprintf(stderr, "unable to set write chunksize: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
 		return ret;
 	}
 
-	if ((ret = ftdi_write_data_set_chunksize(&ftdic, USBBUFSIZE))  != 0) {
-		fprintf(stderr, "unable to set write chunksize: %d (%s)\n", ret, ftdi_get_error_string(&ftdic));
+	if ((ret = ftdi_read_data_set_chunksize(&jk->ftdic, FTDI_CHUNKSIZE))  != 0) {
+		fprintf(stderr, "unable to set read chunksize: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
 		return ret;
 	}
 
-	if ((ret = ftdi_read_data_set_chunksize(&ftdic, USBBUFSIZE))  != 0) {
-		fprintf(stderr, "unable to set read chunksize: %d (%s)\n", ret, ftdi_get_error_string(&ftdic));
+	jtagkey_ctrl_init(jk);
+
+	if ((ret = jtagkey_latency(jk, OTHER_LATENCY)) != 0)
+		return ret;
+
+	if ((ret = jtagkey_reader_start(jk)) != 0)
 		return ret;
+
+	jtagkey_chip(jk);
+
+	/* The MPSSE engine has TCK, TDI, TDO and TMS on fixed pins and doesn't invert */
+	if (jk->mpsse && (jk->layout.tck != JTAGKEY_TCK || jk->layout.tdi != JTAGKEY_TDI ||
+			jk->layout.tdo != JTAGKEY_TDO || jk->layout.tms != JTAGKEY_TMS || jk->layout.tdo_low)) {
+		DPRINTF("layout %s does not fit MPSSE, using bit-bang\n", jk->layout.name);
+		jk->mpsse = 0;
+		jk->hispeed = 0;
 	}
 
-	if ((ret = jtagkey_latency(OTHER_LATENCY)) != 0)
+	if (jk->mpsse) {
+		if ((ret = jtagkey_mpsse_init(jk, MPSSE_SPEED, flags)) != 0)
+			return ret;
+
+		if (speed == CONFIG_SPEED_AUTO)
+			speed = jtagkey_autotune(jk, vid, pid);
+
+		if (speed && speed != MPSSE_SPEED)
+			ret = jtagkey_mpsse_speed(jk, speed);
+
 		return ret;
+	}
 
-	c = 0x00;
-	ftdi_write_data(&ftdic, &c, 1);
+	c = jk->oe_on;
+	ftdi_write_data(&jk->ftdic, &c, 1);
 
-	if ((ret = ftdi_set_bitmode(&ftdic, JTAGKEY_TCK|JTAGKEY_TDI|JTAGKEY_TMS|JTAGKEY_OEn, BITMODE_SYNCBB))  != 0) {
-		fprintf(stderr, "unable to enable bitbang mode: %d (%s)\n", ret, ftdi_get_error_string(&ftdic));
+	if ((ret = ftdi_set_bitmode(&jk->ftdic, jk->pin_dir, BITMODE_SYNCBB))  != 0) {
+		fprintf(stderr, "unable to enable bitbang mode: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
 		return ret;
 	}
+	jk->bitbang_mode = BITMODE_SYNCBB;
+
+	/* TCK needs two bit-bang cycles, there is nothing to tune */
+	if (speed == CONFIG_SPEED_AUTO) {
+		fprintf(stderr, "speed=auto needs an MPSSE capable FTDI chip, using %d Hz\n", JTAG_SPEED * BITBANG_RATE / 2);
+		speed = 0;
+	}
 
-	if ((ret = ftdi_set_baudrate(&ftdic, JTAG_SPEED))  != 0) {
-		fprintf(stderr, "unable to set baudrate: %d (%s)\n", ret, ftdi_get_error_string(&ftdic));
+	/* speed= is the TCK frequency, round down so TCK doesn't exceed it */
+	baud = JTAG_SPEED;
+	if (speed) {
+		baud = (speed * 2) / BITBANG_RATE;
+		if (!baud)
+			baud = 1;
+	}
+
+	DPRINTF("bit-bang: %d baud, TCK %d Hz\n", baud, baud * BITBANG_RATE / 2);
+
+	if ((ret = ftdi_set_baudrate(&jk->ftdic, baud))  != 0) {
+		fprintf(stderr, "unable to set baudrate: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
 		return ret;
 	}
 
-	if ((ret = ftdi_usb_purge_buffers(&ftdic))  != 0) {
-		fprintf(stderr, "unable to purge buffers: %d (%s)\n", ret, ftdi_get_error_string(&ftdic));
+	if ((ret = ftdi_usb_purge_buffers(&jk->ftdic))  != 0) {
+		fprintf(stderr, "unable to purge buffers: %d (%s)\n", ret, ftdi_get_error_string(&jk->ftdic));
 		return ret;
 	}
 
 	return ret;
 }
 
+static void jtagkey_dev_free(struct jtagkey_dev *jk) {
+#ifdef JTAGKEY_ASYNC
+	if (jk->async)
+		jtagkey_async_close(jk->async, &jk->ftdic);
+#endif
+	jtagkey_reader_stop(jk);
+	if (jk->ftdi_opened) {
+		ftdi_disable_bitbang(&jk->ftdic);
+		ftdi_usb_close(&jk->ftdic);
+	}
+	if (jk->ftdi_inited)
+		ftdi_deinit(&jk->ftdic);
+
+	free(jk->mpsse_s.cmd);
+	free(jk->mpsse_s.reads);
+	free(jk->mpsse_s.resp);
+	free(jk->rpos);
+	free(jk->sread);
+	free(jk->xcache.slots);
+	free(jk->writebuf);
+	free(jk->readbuf);
+	free(jk);
+}
+
+#ifdef JTAGKEY_ASYNC
+/* One round trip through the libusb-1.0 transport before it is used */
+static int jtagkey_async_check(struct jtagkey_dev *jk) {
+	unsigned char buf[2];
+	unsigned char c;
+	int len;
+
+	if (jk->mpsse) {
+		buf[0] = GET_BITS_LOW;
+		buf[1] = SEND_IMMEDIATE;
+		len = 2;
+	} else {
+		/* the pins keep the state jtagkey_init left them in */
+		buf[0] = jk->oe_on;
+		len = 1;
+	}
+
+	return jtagkey_async_xfer(jk->async, buf, len, &c, 1);
+}
+#endif
+
+static struct jtagkey_dev *jtagkey_dev_new(unsigned short vid, unsigned short pid, unsigned short iface, const char *serial, unsigned long speed, unsigned int flags, const struct jtagkey_layout *l) {
+	struct jtagkey_dev *jk;
+
+	if (!(jk = calloc(1, sizeof(struct jtagkey_dev))))
+		return NULL;
+
+	jk->bitbang_mode = BITMODE_SYNCBB;
+	jk->mpsse_base = MPSSE_CLOCK;
+	jk->writebuf = malloc(POOL_MIN);
+	jk->readbuf = malloc(POOL_MIN);
+	jk->writepos = jk->writebuf;
+	jk->bufsize = POOL_MIN;
+	jk->buftrim = POOL_TRIM;
+
+	if (!jk->writebuf || !jk->readbuf) {
+		fprintf(stderr, "unable to allocate buffers for ftdi device %04x:%04x\n", vid, pid);
+		jtagkey_dev_free(jk);
+		return NULL;
+	}
+
+	if (jtagkey_init(jk, vid, pid, iface, serial, speed, flags, l) < 0) {
+		jtagkey_dev_free(jk);
+		return NULL;
+	}
+
+	if (flags & CONFIG_FLAG_ASYNC) {
+#ifdef JTAGKEY_ASYNC
+		if (!(jk->async = jtagkey_async_open(&jk->ftdic))) {
+			fprintf(stderr, "unable to use libusb-1.0 for ftdi device %04x:%04x, using libftdi\n", vid, pid);
+		} else if (jtagkey_async_check(jk) != 0) {
+			fprintf(stderr, "libusb-1.0 transfers to ftdi device %04x:%04x failed, using libftdi\n", vid, pid);
+			jtagkey_async_close(jk->async, &jk->ftdic);
+			jk->async = NULL;
+		}
+#else
+		fprintf(stderr, "async needs libusb-driver built with libusb-1.0, ignored\n");
+#endif
+	}
+
+	return jk;
+}
+
 int jtagkey_open(int num) {
-	int ret;
+	struct jtagkey_dev *jk;
 
-	ret = jtagkey_init(config_usb_vid(num), config_usb_pid(num), config_usb_iface(num));
+	if (num < 0 || num >= CONFIG_MAX_PORTS)
+		return -ENODEV;
 
-	if (ret >= 0)
-		ret = 0xff;
+	if (devs[num])
+		return JTAGKEY_HANDLE(num);
 
-	return ret;
+	jk = jtagkey_dev_new(config_usb_vid(num), config_usb_pid(num), config_usb_iface(num), config_usb_serial(num), config_usb_speed(num), config_usb_flags(num), config_usb_layout(num));
+	if (!jk)
+		return -ENODEV;
+
+	devs[num] = jk;
+
+	return JTAGKEY_HANDLE(num);
 }
 
 void jtagkey_close(int handle) {
-	if (handle == 0xff) {
-		ftdi_disable_bitbang(&ftdic);
-		ftdi_usb_close(&ftdic);
-		ftdi_deinit(&ftdic);
+	int num = handle - JTAGKEY_HANDLE(0);
+
+	if (num < 0 || num >= CONFIG_MAX_PORTS || !devs[num])
+		return;
+
+	jtagkey_ctrl_stats(devs[num]);
+	jtagkey_dev_free(devs[num]);
+	devs[num] = NULL;
+}
+
+/*
+ * Interface for the Platform Cable USB emulation in xpcu.c, which drives
+ * the TAP directly instead of going through the parallel port pin states.
+ */
+int jtagkey_xpcu_open(void) {
+	struct ftdi_config *cfg = config_xpcu_ftdi();
+	struct jtagkey_dev *jk;
+
+	if (!cfg)
+		return -ENODEV;
+
+	if (xpcu_dev) {
+		xpcu_refs++;
+		return 0;
+	}
+
+	jk = jtagkey_dev_new(cfg->usb_vid, cfg->usb_pid, cfg->usb_iface, cfg->usb_serial, cfg->usb_speed, cfg->usb_flags, cfg->usb_layout);
+	if (!jk)
+		return -ENODEV;
+
+	if (!jk->mpsse) {
+		fprintf(stderr, "FTDI cable %04x:%04x can not be used as Platform Cable USB, MPSSE is required\n", cfg->usb_vid, cfg->usb_pid);
+		jtagkey_dev_free(jk);
+		return -ENODEV;
+	}
+
+	xpcu_dev = jk;
+	xpcu_refs = 1;
+
+	return 0;
+}
+
+void jtagkey_xpcu_close(void) {
+	if (!xpcu_dev || --xpcu_refs > 0)
+		return;
+
+	jtagkey_ctrl_stats(xpcu_dev);
+	jtagkey_dev_free(xpcu_dev);
+	xpcu_dev = NULL;
+}
+
+/*
+ * Clock len bits through the TAP. Every byte of clk holds JTAGKEY_TDI and
+ * JTAGKEY_TMS for one clock, JTAGKEY_TDO requests TDO to be sampled. The
+ * sampled values are stored as JTAGKEY_TDO in the same position of tdo.
+ */
+static int jtagkey_dev_shift(struct jtagkey_dev *jk, unsigned char *clk, int len, unsigned char *tdo) {
+	struct mpsse_s *m = &jk->mpsse_s;
+	int i;
+
+	mpsse_begin(m);
+
+	if (m->state & JTAGKEY_TCK) {
+		mpsse_set_bits(m, m->state & ~JTAGKEY_TCK);
+		m->state &= ~JTAGKEY_TCK;
+	}
+
+	for (i = 0; i < len; i++)
+		mpsse_clock(m, (clk[i] & JTAGKEY_TMS) ? 1 : 0,
+				(clk[i] & JTAGKEY_TDI) ? 1 : 0,
+				(clk[i] & JTAGKEY_TDO) ? i : -1);
+
+	mpsse_flush_run(m);
+
+	if (len) {
+		m->state &= ~(JTAGKEY_TDI|JTAGKEY_TMS);
+		m->state |= clk[len-1] & (JTAGKEY_TDI|JTAGKEY_TMS);
+	}
+
+	return mpsse_execute(jk, tdo);
+}
+
+int jtagkey_shift(unsigned char *clk, int len, unsigned char *tdo) {
+	if (!xpcu_dev)
+		return -ENODEV;
+
+	return jtagkey_dev_shift(xpcu_dev, clk, len, tdo);
+}
+
+/* Set TDI, TMS, TCK and OEn, only the JTAGKEY_* bits are used */
+int jtagkey_set_pins(unsigned char pins) {
+	struct jtagkey_dev *jk = xpcu_dev;
+	struct mpsse_s *m;
+	unsigned char *cmd;
+
+	if (!jk)
+		return -ENODEV;
+
+	m = &jk->mpsse_s;
+
+	pins &= JTAGKEY_TCK|JTAGKEY_TDI|JTAGKEY_TMS|JTAGKEY_OEn;
+	pins = (pins & ~JTAGKEY_OEn) | ((pins & JTAGKEY_OEn) ? jk->oe_off : jk->oe_on);
+
+	mpsse_begin(m);
+	mpsse_set_bits(m, pins);
+
+	/* mpsse_set_bits never raises TCK as clocks have to start low */
+	if ((pins & JTAGKEY_TCK) && (cmd = mpsse_grow(m, 3))) {
+		cmd[0] = SET_BITS_LOW;
+		cmd[1] = pins;
+		cmd[2] = jk->pin_dir;
 	}
+
+	m->state = pins;
+	m->lastclk = -1;
+
+	return mpsse_execute(jk, NULL);
+}
+
+/* Read all pins of the JTAG port, -errno on failure */
+int jtagkey_get_pins(void) {
+	struct jtagkey_dev *jk = xpcu_dev;
+	struct mpsse_s *m;
+	unsigned char pins;
+	int ret;
+
+	if (!jk)
+		return -ENODEV;
+
+	m = &jk->mpsse_s;
+
+	mpsse_begin(m);
+	mpsse_get_bits(m, 0);
+
+	if ((ret = mpsse_execute(jk, &pins)) < 0)
+		return ret;
+
+	return pins;
 }
 
 #ifdef DEBUG
-static void jtagkey_state(unsigned char data) {
+static void jtagkey_state(struct jtagkey_dev *jk, unsigned char data) {
 	fprintf(stderr,"Pins high: ");
 
-	if (data & JTAGKEY_TCK)
+	if (data & jk->layout.tck)
 		fprintf(stderr,"TCK ");
 
-	if (data & JTAGKEY_TDI)
+	if (data & jk->layout.tdi)
 		fprintf(stderr,"TDI ");
 
-	if (data & JTAGKEY_TDO)
+	if (data & jk->layout.tdo)
 		fprintf(stderr,"TDO ");
 
-	if (data & JTAGKEY_TMS)
+	if (data & jk->layout.tms)
 		fprintf(stderr,"TMS ");
 
 	if (data & JTAGKEY_VREF)
@@ -132,72 +1527,93 @@ static void jtagkey_state(unsigned char data) {
 }
 #endif
 
-struct jtagkey_reader_arg {
-	int		num;
-	unsigned char	*buf;
-};
+/*
+ * The pin state buffers grow with the largest batch impact sends and are
+ * reused for every flush. Once a while they are shrunk again if the recent
+ * flushes only used a small part of them.
+ */
+static int jtagkey_pool_reserve(struct jtagkey_dev *jk, int len) {
+	int size = jk->bufsize;
+	int used = jk->writepos - jk->writebuf;
+	unsigned char *wbuf, *rbuf;
+
+	if (len <= size)
+		return 0;
+
+	while (size < len)
+		size *= 2;
+
+	/* the read buffer is scratch, pending pin states have to be kept */
+	if (!(rbuf = malloc(size)))
+		return -ENOMEM;
+
+	if (!(wbuf = realloc(jk->writebuf, size))) {
+		free(rbuf);
+		return -ENOMEM;
+	}
 
-static void *jtagkey_reader(void *thread_arg) {
-	struct jtagkey_reader_arg *arg = (struct jtagkey_reader_arg*)thread_arg;
-	int i;
+	free(jk->readbuf);
+	jk->readbuf = rbuf;
+	jk->writebuf = wbuf;
+	jk->writepos = wbuf + used;
 
-	i = 0;
-	DPRINTF("reader for %d bytes\n", arg->num);
-	while (i < arg->num) {
-		i += ftdi_read_data(&ftdic, arg->buf + i, arg->num - i);
-	}
-	
-	pthread_exit(NULL);
+	DPRINTF("pin state buffers grown to %d bytes\n", size);
+	jk->bufsize = size;
+
+	return 0;
 }
 
-/* TODO: Interpret JTAG commands and transfer in MPSSE mode */
-int jtagkey_transfer(WD_TRANSFER *tr, int fd, unsigned int request, int ppbase, int ecpbase, int num) {
-	int ret = 0;
-	int i;
-	int nread = 0;
-	unsigned long port;
-	unsigned char val;
-	static unsigned char last_data = 0;
-	static unsigned char last_write = 0x00;
-	static unsigned char writebuf[USBBUFSIZE], *writepos = writebuf;
-	static unsigned char readbuf[USBBUFSIZE], *readpos;
-	unsigned char data, prev_data, last_cyc_write;
-	struct jtagkey_reader_arg targ;
-	pthread_t reader_thread;
+/* Called after a flush emptied the buffers */
+static void jtagkey_pool_flushed(struct jtagkey_dev *jk, int len) {
+	int size;
+	unsigned char *wbuf, *rbuf;
 
-	/* Count reads */
-	for (i = 0; i < num; i++)
-		if (tr[i].cmdTrans == PP_READ)
-			nread++;
+	if (len > jk->bufpeak)
+		jk->bufpeak = len;
 
-	/* Write combining */
-	if ((writepos-writebuf > sizeof(writebuf)-num) || (nread && writepos-writebuf)) {
-		unsigned char *pos = writebuf;
-		int len;
+	if (--jk->buftrim > 0)
+		return;
 
-		DPRINTF("writing %zd bytes due to %d following reads in %d chunks or full buffer\n", writepos-writebuf, nread, num);
-		jtagkey_latency(BULK_LATENCY);
+	size = jk->bufsize;
+	while (size > POOL_MIN && size / 4 >= jk->bufpeak)
+		size /= 2;
 
-		targ.num = writepos-pos;
-		targ.buf = readbuf;
-		pthread_create(&reader_thread, NULL, &jtagkey_reader, &targ);
+	jk->buftrim = POOL_TRIM;
+	jk->bufpeak = 0;
 
-		while (pos < writepos) {
-			len = writepos-pos;
+	if (size == jk->bufsize)
+		return;
 
-			if (len > USBBUFSIZE)
-				len = USBBUFSIZE;
+	/* the buffers are empty, if the new ones can't be allocated keep the old */
+	wbuf = malloc(size);
+	rbuf = malloc(size);
+	if (!wbuf || !rbuf) {
+		free(wbuf);
+		free(rbuf);
+		return;
+	}
 
-			DPRINTF("combined write of %d/%zd\n",len,writepos-pos);
-			ftdi_write_data(&ftdic, pos, len);
-			pos += len;
-		}
-		pthread_join(reader_thread, NULL);
+	free(jk->writebuf);
+	free(jk->readbuf);
+	jk->writebuf = wbuf;
+	jk->writepos = wbuf;
+	jk->readbuf = rbuf;
+	jk->bufsize = size;
 
-		writepos = writebuf;
-	}
+	DPRINTF("pin state buffers shrunk to %d bytes\n", size);
+}
 
-	last_cyc_write = last_write;
+/*
+ * Translate the transfers to pin states in a single pass. Status reads
+ * are remembered with everything needed to answer them, so the results
+ * can be filled in without walking the transfers again.
+ */
+static int jtagkey_translate(struct jtagkey_dev *jk, WD_TRANSFER *tr, int num, int ppbase, int *nr, int *nsread) {
+	unsigned char *writebuf = jk->writebuf;
+	unsigned char val, prev_data;
+	unsigned long port;
+	int ret = 0;
+	int i;
 
 	for (i = 0; i < num; i++) {
 		DPRINTF("dwPort: 0x%lx, cmdTrans: %lu, dwbytes: %ld, fautoinc: %ld, dwoptions: %ld\n",
@@ -207,6 +1623,31 @@ int jtagkey_transfer(WD_TRANSFER *tr, int fd, unsigned int request, int ppbase,
 		port = (unsigned long)tr[i].dwPort;
 		val = tr[i].Data.Byte;
 
+		if (tr[i].cmdTrans == PP_READ) {
+			/* Pad writebuf, the sample for this read will be in the next byte */
+			*jk->writepos = jk->last_data;
+			jk->rpos[(*nr)++] = jk->writepos-writebuf;
+
+			/* We don't support reading of the data port */
+			if (port == ppbase + PP_STATUS) {
+				jk->sread[*nsread].elem = i;
+				jk->sread[*nsread].pos = jk->writepos-writebuf;
+				jk->sread[*nsread].last_write = jk->last_write;
+				(*nsread)++;
+			}
+
+			jk->writepos++;
+			continue;
+		}
+
+		if (tr[i].cmdTrans != PP_WRITE) {
+			if ((port == ppbase + PP_DATA) || (port == ppbase + PP_STATUS)) {
+				fprintf(stderr,"!!!Unsupported TRANSFER command: %lu!!!\n", tr[i].cmdTrans);
+				ret = -1;
+			}
+			val = jk->last_write;
+		}
+
 #ifdef DEBUG
 		if (tr[i].cmdTrans == 13)
 			DPRINTF("write byte: %d\n", val);
@@ -215,160 +1656,274 @@ int jtagkey_transfer(WD_TRANSFER *tr, int fd, unsigned int request, int ppbase,
 			jtagmon(val & PP_TCK, val & PP_TMS, val & PP_TDI);
 #endif
 
-		/* Pad writebuf for read-commands in stream */
-		*writepos = last_data;
-		prev_data = last_data;
+		prev_data = jk->last_data;
 
+		/* Status Port is readonly, other ports don't change the pins */
 		if (port == ppbase + PP_DATA) {
-			DPRINTF("data port\n");
+			jk->last_data = jk->pp2pins[val & 0x0f];
+			jk->last_write = val;
+		}
 
-			data = 0x00;
-			switch(tr[i].cmdTrans) {
-				case PP_READ:
-					ret = 0; /* We don't support reading of the data port */
-					break;
+		*jk->writepos = jk->last_data;
 
-				case PP_WRITE:
-					if (val & PP_TDI) {
-						data |= JTAGKEY_TDI;
-						DPRINTF("TDI\n");
-					} else {
-						DPRINTF("!TDI\n");
-					}
-					if (val & PP_TCK) {
-						data |= JTAGKEY_TCK;
-						DPRINTF("TCK\n");
-					} else {
-						DPRINTF("!TCK\n");
-					}
-					if (val & PP_TMS) {
-						data |= JTAGKEY_TMS;
-						DPRINTF("TMS\n");
-					} else {
-						DPRINTF("!TMS\n");
-					}
-					if (val & PP_CTRL) {
-						data = JTAGKEY_OEn;
-						DPRINTF("CTRL\n");
-					} else {
-						DPRINTF("!CTRL\n");
-					}
-
-					if (val & PP_PROG) {
-						DPRINTF("PROG\n");
-					} else {
-						DPRINTF("!PROG\n");
-					}
-
-					*writepos = data;
-
-					last_data = data;
-					last_write = val;
-					break;
+		/* Only changes of the pins have to be sent */
+		if ((jk->last_data != prev_data) || (i == num-1))
+			jk->writepos++;
+	}
 
-				default:
-					fprintf(stderr,"!!!Unsupported TRANSFER command: %lu!!!\n", tr[i].cmdTrans);
-					ret = -1;
-					break;
-			}
-		}
 
-		if ((tr[i].cmdTrans == PP_READ) || (*writepos != prev_data) || (i == num-1))
-			writepos++;
+	return ret;
+}
+
+/*
+ * Look the batch up in the translation cache. The key is built even if the
+ * cache is still empty, jtagkey_xcache_store() uses it after a miss.
+ */
+static int jtagkey_xcache_lookup(struct jtagkey_dev *jk, WD_TRANSFER *tr, int num, int ppbase, int *nr, int *nsread) {
+	struct jtagkey_xcache_s *x = &jk->xcache;
+	struct jtagkey_xcache_entry *e;
+	unsigned char *k = x->key;
+	uint32_t hash = 2166136261u;
+	unsigned long port;
+	int i;
+
+	x->keylen = 0;
+
+	if (num > XCACHE_MAX)
+		return 0;
+
+	/* Only what the translation looks at, other ports and commands are alike */
+	*k++ = jk->last_data;
+	*k++ = jk->last_write;
+	for (i = 0; i < num; i++) {
+		port = (unsigned long)tr[i].dwPort - ppbase;
+		*k++ = (port == PP_DATA || port == PP_STATUS) ? port : 0xff;
+		*k++ = (tr[i].cmdTrans == PP_READ) ? 0 : ((tr[i].cmdTrans == PP_WRITE) ? 1 : 2);
+		/* reads return their result in Data */
+		*k++ = (tr[i].cmdTrans == PP_WRITE) ? tr[i].Data.Byte : 0;
 	}
 
-	if (nread)
-	{
-		DPRINTF("writing %zd bytes\n", writepos-writebuf);
+	x->keylen = k - x->key;
+
+	/* FNV-1a */
+	for (i = 0; i < x->keylen; i++)
+		hash = (hash ^ x->key[i]) * 16777619u;
+
+	x->hash = hash;
+	x->lookups++;
 
-		*writepos = last_data;
-		writepos++;
+	if (!x->slots)
+		return 0;
 
-		jtagkey_latency(OTHER_LATENCY);
+	e = &(x->slots[hash % XCACHE_SLOTS]);
+	if (e->num != num || e->hash != hash || memcmp(e->key, x->key, x->keylen))
+		return 0;
 
-		targ.num = writepos-writebuf;
-		targ.buf = readbuf;
-		pthread_create(&reader_thread, NULL, &jtagkey_reader, &targ);
-		ftdi_write_data(&ftdic, writebuf, writepos-writebuf);
-		pthread_join(reader_thread, NULL);
+	memcpy(jk->writebuf, e->pins, e->npins);
+	jk->writepos = jk->writebuf + e->npins;
+	memcpy(jk->rpos, e->rpos, e->nr * sizeof(int));
+	memcpy(jk->sread, e->sread, e->nsread * sizeof(struct jtagkey_status_read));
+	*nr = e->nr;
+	*nsread = e->nsread;
+	jk->last_data = e->last_data;
+	jk->last_write = e->last_write;
 
 #ifdef DEBUG
-		hexdump(writebuf, writepos-writebuf, "->");
-		hexdump(readbuf, i, "<-");
+	/* jtagmon sees the writes like in jtagkey_translate */
+	for (i = 0; i < num; i++) {
+		if (tr[i].cmdTrans == 13)
+			jtagmon(tr[i].Data.Byte & PP_TCK, tr[i].Data.Byte & PP_TMS, tr[i].Data.Byte & PP_TDI);
+	}
 #endif
 
-		writepos = writebuf;
-	} else {
-		return ret;
-	}
+	x->hits++;
 
-	readpos = readbuf;
-	last_write = last_cyc_write;
+	return 1;
+}
 
-	for (i = 0; i < num; i++) {
-		DPRINTF("dwPort: 0x%lx, cmdTrans: %lu, dwbytes: %ld, fautoinc: %ld, dwoptions: %ld\n",
-				(unsigned long)tr[i].dwPort, tr[i].cmdTrans, tr[i].dwBytes,
-				tr[i].fAutoinc, tr[i].dwOptions);
+/* Remember the batch just translated, it started with an empty buffer */
+static void jtagkey_xcache_store(struct jtagkey_dev *jk, int num, int nr, int nsread) {
+	struct jtagkey_xcache_s *x = &jk->xcache;
+	struct jtagkey_xcache_entry *e;
+
+	if (!x->keylen)
+		return;
+
+	if (!x->slots && !(x->slots = calloc(XCACHE_SLOTS, sizeof(struct jtagkey_xcache_entry))))
+		return;
+
+	e = &(x->slots[x->hash % XCACHE_SLOTS]);
+	e->hash = x->hash;
+	e->num = num;
+	memcpy(e->key, x->key, x->keylen);
+	e->npins = jk->writepos - jk->writebuf;
+	memcpy(e->pins, jk->writebuf, e->npins);
+	e->nr = nr;
+	memcpy(e->rpos, jk->rpos, nr * sizeof(int));
+	e->nsread = nsread;
+	memcpy(e->sread, jk->sread, nsread * sizeof(struct jtagkey_status_read));
+	e->last_data = jk->last_data;
+	e->last_write = jk->last_write;
+}
 
-		port = (unsigned long)tr[i].dwPort;
-		val = tr[i].Data.Byte;
+int jtagkey_transfer(WD_TRANSFER *tr, int fd, unsigned int request, int ppbase, int ecpbase, int num) {
+	int ret = 0, err;
+	int i;
+	int nread = 0;
+	unsigned char val;
+	struct jtagkey_dev *jk;
+	unsigned char *writebuf, *readbuf;
+	struct jtagkey_status_read *sread;
+	unsigned char data;
+	struct timeval start;
+	int nr = 0, nsread = 0;
+	int *rpos;
+	int len;
+
+	/* The port number is encoded in the (virtual) I/O address */
+	if (ppbase / 0x10 >= CONFIG_MAX_PORTS || !(jk = devs[ppbase / 0x10]))
+		return -ENODEV;
 
-		if ((tr[i].cmdTrans != PP_READ) && (val == last_write) && (i != num-1))
-			continue;
+	/* Count reads */
+	for (i = 0; i < num; i++)
+		if (tr[i].cmdTrans == PP_READ)
+			nread++;
 
-		readpos++;
+	if (nread > jk->maxrpos) {
+		int *newrpos = realloc(jk->rpos, nread * sizeof(int));
+		struct jtagkey_status_read *newsread;
 
-		if (port == ppbase + PP_DATA) {
-			if (tr[i].cmdTrans == PP_WRITE) {
-				last_write = val;
-			}
-		} else if (port == ppbase + PP_STATUS) {
-			DPRINTF("status port (last write: 0x%x)\n", last_write);
-			switch(tr[i].cmdTrans) {
-				case PP_READ:
-					data = *readpos;
+		if (!newrpos)
+			return -ENOMEM;
 
-#ifdef DEBUG
-					DPRINTF("READ: 0x%x\n", data);
-					jtagkey_state(data);
-#endif
+		jk->rpos = newrpos;
 
-					val = 0x00;
-					if ((data & JTAGKEY_TDO) && (last_write & PP_PROG))
-						val |= PP_TDO;
+		newsread = realloc(jk->sread, nread * sizeof(struct jtagkey_status_read));
+		if (!newsread)
+			return -ENOMEM;
 
-					if (~last_write & PP_PROG)
-						val |= 0x08;
+		jk->sread = newsread;
+		jk->maxrpos = nread;
+	}
 
-					if (last_write & 0x40)
-						val |= 0x20;
-					else
-						val |= 0x80;
-					break;
+	rpos = jk->rpos;
+	sread = jk->sread;
+	writebuf = jk->writebuf;
+	readbuf = jk->readbuf;
 
-				case PP_WRITE:
-					ret = 0; /* Status Port is readonly */
-					break;
+	/* Write combining */
+	if ((jk->writepos-writebuf > USBBUFSIZE-num) ||
+			(jk->writepos-writebuf >= jk->ctrl.flush_threshold) ||
+			(nread && jk->writepos-writebuf)) {
+		DPRINTF("writing %zd bytes due to %d following reads in %d chunks or full buffer\n", jk->writepos-writebuf, nread, num);
 
-				default:
-					fprintf(stderr,"!!!Unsupported TRANSFER command: %lu!!!\n", tr[i].cmdTrans);
-					ret = -1;
-					break;
-			}
+		if (!nread && (jk->writepos-writebuf <= USBBUFSIZE-num))
+			jk->ctrl.early_flushes++;
+
+		jtagkey_ctrl_begin(jk, 0, &start);
+
+		if (jk->mpsse) {
+			/* No reads, so the chip doesn't send anything back */
+			err = jtagkey_mpsse_xfer(jk, writebuf, jk->writepos-writebuf, NULL, NULL, 0);
 		} else {
-			ret = 0;
+			/* Long writes don't need the samples, save half the traffic */
+			if (jk->writepos-writebuf >= ASYNC_MIN)
+				jtagkey_bitbang_mode(jk, BITMODE_BITBANG);
+
+			DPRINTF("combined write of %zd\n", jk->writepos-writebuf);
+			err = jtagkey_xfer(jk, writebuf, jk->writepos-writebuf, readbuf,
+					(jk->bitbang_mode == BITMODE_SYNCBB) ? jk->writepos-writebuf : 0);
 		}
 
-		tr[i].Data.Byte = val;
+		if (err < 0) {
+			jk->writepos = writebuf;
+			return err;
+		}
+
+		jtagkey_ctrl_end(jk, 0, jk->writepos-writebuf, &start);
+
+		len = jk->writepos-writebuf;
+		jk->writepos = writebuf;
+		jtagkey_pool_flushed(jk, len);
+	}
+
+	/* Every transfer takes at most one byte, plus the sample after the last read */
+	if (jtagkey_pool_reserve(jk, (jk->writepos-jk->writebuf) + num + 1) != 0) {
+		fprintf(stderr, "unable to allocate %d bytes for pin states\n", num + 1);
+		return -ENOMEM;
+	}
+
+	writebuf = jk->writebuf;
+	readbuf = jk->readbuf;
+
+	if (!nread || !jtagkey_xcache_lookup(jk, tr, num, ppbase, &nr, &nsread)) {
+		ret = jtagkey_translate(jk, tr, num, ppbase, &nr, &nsread);
+
+		if (nread && !ret)
+			jtagkey_xcache_store(jk, num, nr, nsread);
+	}
+
+	if (!nread)
+		return ret;
+
+	DPRINTF("writing %zd bytes\n", jk->writepos-writebuf);
+
+	*jk->writepos = jk->last_data;
+	jk->writepos++;
+
+	jtagkey_ctrl_begin(jk, 1, &start);
+
+	if (jk->mpsse) {
+		err = jtagkey_mpsse_xfer(jk, writebuf, jk->writepos-writebuf, readbuf, rpos, nr);
+	} else {
+		jtagkey_bitbang_mode(jk, BITMODE_SYNCBB);
+
+		err = jtagkey_xfer(jk, writebuf, jk->writepos-writebuf, readbuf, jk->writepos-writebuf);
+	}
+
+	/* readbuf holds nothing useful */
+	if (err < 0) {
+		jk->writepos = writebuf;
+		return err;
+	}
+
+	jtagkey_ctrl_end(jk, 1, jk->writepos-writebuf, &start);
+
+#ifdef DEBUG
+	hexdump(writebuf, jk->writepos-writebuf, "->");
+	hexdump(readbuf, jk->writepos-writebuf, "<-");
+#endif
+
+	len = jk->writepos-writebuf;
+	jk->writepos = writebuf;
+
+	for (i = 0; i < nsread; i++) {
+		struct jtagkey_status_read *r = &(sread[i]);
+
+		data = readbuf[r->pos+1];
 
-		DPRINTF("dwPortReturn: 0x%lx, cmdTrans: %lu, dwbytes: %ld, fautoinc: %ld, dwoptions: %ld\n",
-				(unsigned long)tr[i].dwPort, tr[i].cmdTrans, tr[i].dwBytes,
-				tr[i].fAutoinc, tr[i].dwOptions);
 #ifdef DEBUG
-		if (tr[i].cmdTrans == 10)
-			DPRINTF("read byte: %d\n", tr[i].Data.Byte);
+		DPRINTF("status port (last write: 0x%x)\n", r->last_write);
+		DPRINTF("READ: 0x%x\n", data);
+		jtagkey_state(jk, data);
 #endif
+
+		val = 0x00;
+		if ((jk->pins2status[data] & PP_TDO) && (r->last_write & PP_PROG))
+			val |= PP_TDO;
+
+		if (~r->last_write & PP_PROG)
+			val |= 0x08;
+
+		if (r->last_write & 0x40)
+			val |= 0x20;
+		else
+			val |= 0x80;
+
+		tr[r->elem].Data.Byte = val;
 	}
 
+	jtagkey_pool_flushed(jk, len);
+
 	return ret;
 }
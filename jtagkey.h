@@ -5,6 +5,29 @@
 #define JTAGKEY_VREF	0x20
 #define JTAGKEY_OEn	0x10
 
+/*
+ * Wiring of an FTDI cable, bits of ADBUS (low byte) and ACBUS (high byte).
+ * The JTAGKEY_* values above are the pins the MPSSE engine uses and are
+ * used as logical pins everywhere else.
+ */
+struct jtagkey_layout {
+	const char	*name;
+	unsigned char	tck;
+	unsigned char	tdi;
+	unsigned char	tdo;
+	unsigned char	tms;
+	unsigned char	oe;		/* output enable, 0 if the cable has none */
+	unsigned char	oe_low;		/* oe is active low */
+	unsigned char	tdo_low;	/* tdo is inverted by the cable */
+	unsigned char	high_value;
+	unsigned char	high_dir;	/* ACBUS is left alone if 0 */
+};
+
 int __attribute__ ((visibility ("hidden"))) jtagkey_transfer(WD_TRANSFER *tr, int fd, unsigned int request, int ppbase, int ecpbase, int num);
 int __attribute__ ((visibility ("hidden"))) jtagkey_open(int num);
 void __attribute__ ((visibility ("hidden"))) jtagkey_close(int handle);
+int __attribute__ ((visibility ("hidden"))) jtagkey_xpcu_open(void);
+void __attribute__ ((visibility ("hidden"))) jtagkey_xpcu_close(void);
+int __attribute__ ((visibility ("hidden"))) jtagkey_shift(unsigned char *clk, int len, unsigned char *tdo);
+int __attribute__ ((visibility ("hidden"))) jtagkey_set_pins(unsigned char pins);
+int __attribute__ ((visibility ("hidden"))) jtagkey_get_pins(void);
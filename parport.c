@@ -1,30 +1,500 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <linux/parport.h>
 #include <linux/ppdev.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <sys/io.h>
+#define PARPORT_DIRECT
+#endif
 #include "usb-driver.h"
+#include "config.h"
 #include "parport.h"
 
-static int parportfd = -1;
+/* hCard of a port accessed with inb/outb */
+#define PARPORT_DIRECT_HANDLE(num) (0x200 + (num))
+
+/* Mode field of the ECP extended control register */
+#define ECR_MODE(ecr)	((ecr) >> 5)
+#define ECR_SPP		0
+#define ECR_PS2		1
+#define ECR_PPF		2	/* compatibility mode with FIFO */
+#define ECR_ECP		3
+#define ECR_EPP		4
+#define ECR_CNF		7
+
+/* FIFO writes collected for a single write() on ppdev */
+#define PARPORT_FIFO 4096
+/* Polls of the ECR while the FIFO is full with direct access */
+#define PARPORT_FIFO_POLLS 100000
+/* Queued data port writes the write-behind thread may lag behind */
+#define PARPORT_QUEUE_MAX 65536
+/* I/O ports of the SPP and EPP registers, and of the ECP registers */
+#define PARPORT_REGS 8
+#define PARPORT_ECP_REGS 3
+
+/*
+ * Batches with nothing but data port writes don't return anything, they
+ * are queued and written by a thread while impact goes on. Every other
+ * batch waits until the queue is empty.
+ */
+struct parport_writer_s {
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	int		running;
+	int		stop;
+	unsigned char	*queue;	/* values not yet taken by the thread */
+	int		nqueue;
+	int		size;
+	int		busy;	/* the thread is writing */
+	int		ret;	/* 0 or the first error since the last wait */
+};
+
+/*
+ * An opened /dev/parportN. The port stays claimed while it is open, so
+ * nobody else can change the registers and writes of the value they
+ * already hold can be skipped.
+ */
+struct parport_dev {
+	int fd;			/* ppdev, or PARPORT_DIRECT_HANDLE() */
+	unsigned long iobase;	/* registers accessed directly if set */
+	unsigned long ecpio;	/* ECP registers with direct access, 0 if none */
+	unsigned char ctr;	/* control register with direct access */
+	unsigned char last_pp_write;
+	unsigned char last_control;
+	int data_valid;		/* last_pp_write is on the port */
+	int control_valid;	/* last_control is on the port */
+	int mode;		/* IEEE 1284 mode of the ppdev port */
+	unsigned char ecr;	/* ECP registers as impact programmed them */
+	unsigned char cfgb;
+	unsigned char fifo[PARPORT_FIFO];
+	int nfifo;
+	struct parport_writer_s writer;
+};
+
+static struct parport_dev *ports[CONFIG_MAX_PORTS];
+
+/* Send the FIFO writes collected on ppdev */
+static int parport_flush(struct parport_dev *pp) {
+	int pos = 0;
+	ssize_t n;
+
+	while (pos < pp->nfifo) {
+		n = write(pp->fd, pp->fifo + pos, pp->nfifo - pos);
+		if (n <= 0) {
+			fprintf(stderr, "parport FIFO write failed after %d of %d bytes: %s\n",
+					pos, pp->nfifo, (n < 0) ? strerror(errno) : "timeout");
+			pp->nfifo = 0;
+			return -1;
+		}
+
+		pos += n;
+	}
+
+	pp->nfifo = 0;
+
+	return 0;
+}
+
+static int parport_queue(struct parport_dev *pp, unsigned char val) {
+	if (pp->nfifo == PARPORT_FIFO && parport_flush(pp) != 0)
+		return -1;
+
+	pp->fifo[pp->nfifo++] = val;
+
+	return 0;
+}
+
+/* Switch the ppdev port to an IEEE 1284 mode, EPP is only selected */
+static int parport_set_mode(struct parport_dev *pp, int mode) {
+	int m;
+
+	if (pp->mode == mode)
+		return 0;
+
+	if (parport_flush(pp) != 0)
+		return -1;
+
+	/* negotiation drives the data and control lines */
+	pp->data_valid = 0;
+	pp->control_valid = 0;
+
+	m = IEEE1284_MODE_COMPAT;
+	if (mode == IEEE1284_MODE_EPP && pp->mode != m && ioctl(pp->fd, PPNEGOT, &m) == -1)
+		return -1;
+
+	m = mode;
+	if (ioctl(pp->fd, (mode == IEEE1284_MODE_EPP) ? PPSETMODE : PPNEGOT, &m) == -1) {
+		fprintf(stderr, "Can't switch parallel port to IEEE 1284 mode 0x%x: %s\n", mode, strerror(errno));
+		return -1;
+	}
+
+	pp->mode = mode;
+
+	return 0;
+}
+
+/* Transfer one byte on ppdev, addr selects the address (ECP: command) channel */
+static int parport_rw(struct parport_dev *pp, int mode, int addr, int rd, unsigned char *val) {
+	int m = mode | (addr ? IEEE1284_ADDR : 0);
+	ssize_t n;
+
+	if (parport_set_mode(pp, mode) != 0 || parport_flush(pp) != 0)
+		return -1;
+
+	if (addr && ioctl(pp->fd, PPSETMODE, &m) == -1)
+		return -1;
+
+	n = rd ? read(pp->fd, val, 1) : write(pp->fd, val, 1);
+
+	if (addr) {
+		m = mode;
+		ioctl(pp->fd, PPSETMODE, &m);
+	}
+
+	return (n == 1) ? 0 : -1;
+}
+
+/*
+ * Register access. Direct access behaves like ppdev with parport_pc: only
+ * the four output lines of the control register are read and written.
+ */
+static int parport_read(struct parport_dev *pp, int reg, unsigned char *val) {
+#ifdef PARPORT_DIRECT
+	if (pp->iobase) {
+		if (reg == PP_CONTROL)
+			*val = pp->ctr & 0x0f;
+		else
+			*val = inb(pp->iobase + reg);
+
+		return 0;
+	}
+#endif
+
+	if (parport_flush(pp) != 0)
+		return -1;
+
+	return ioctl(pp->fd, (reg == PP_STATUS) ? PPRSTATUS : PPRCONTROL, val);
+}
+
+static int parport_write(struct parport_dev *pp, int reg, unsigned char val) {
+#ifdef PARPORT_DIRECT
+	if (pp->iobase) {
+		if (reg == PP_CONTROL) {
+			pp->ctr = (pp->ctr & 0xf0) | (val & 0x0f);
+			val = pp->ctr;
+		}
+
+		outb(val, pp->iobase + reg);
+
+		return 0;
+	}
+#endif
+
+	if (parport_flush(pp) != 0)
+		return -1;
+
+	return ioctl(pp->fd, (reg == PP_DATA) ? PPWDATA : PPWCONTROL, &val);
+}
+
+static int parport_write_data(struct parport_dev *pp, unsigned char val) {
+	int ret;
+
+	if (ECR_MODE(pp->ecr) <= ECR_PS2 && pp->data_valid && val == pp->last_pp_write)
+		return 0;
+
+	ret = parport_write(pp, PP_DATA, val);
+	pp->last_pp_write = val;
+	pp->data_valid = (ret == 0);
+
+	return ret;
+}
+
+static void *parport_writer(void *thread_arg) {
+	struct parport_dev *pp = (struct parport_dev*)thread_arg;
+	struct parport_writer_s *w = &pp->writer;
+	unsigned char *buf = NULL, *tmp;
+	int size = 0, num, i, ret;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->stop) {
+		if (!w->nqueue) {
+			pthread_cond_wait(&w->cond, &w->lock);
+			continue;
+		}
+
+		/* take the queue, new batches go to the other buffer meanwhile */
+		tmp = w->queue;
+		w->queue = buf;
+		buf = tmp;
+		num = w->size;
+		w->size = size;
+		size = num;
+
+		num = w->nqueue;
+		w->nqueue = 0;
+		w->busy = 1;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+
+		DPRINTF("writer for %d bytes\n", num);
+		ret = 0;
+		for (i = 0; i < num && !ret; i++)
+			ret = parport_write_data(pp, buf[i]);
+
+		pthread_mutex_lock(&w->lock);
+		if (ret && !w->ret)
+			w->ret = ret;
+		w->busy = 0;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	free(buf);
+
+	return NULL;
+}
+
+static int parport_writer_start(struct parport_dev *pp) {
+	int ret;
+
+	if (pp->writer.running)
+		return 0;
+
+	pp->writer.stop = 0;
+	pthread_mutex_init(&pp->writer.lock, NULL);
+	pthread_cond_init(&pp->writer.cond, NULL);
+
+	if ((ret = pthread_create(&pp->writer.thread, NULL, &parport_writer, pp)) != 0) {
+		fprintf(stderr, "unable to start parport writer thread: %d\n", ret);
+		pthread_cond_destroy(&pp->writer.cond);
+		pthread_mutex_destroy(&pp->writer.lock);
+		return ret;
+	}
+
+	pp->writer.running = 1;
+
+	return 0;
+}
+
+/* Wait until everything queued is on the port */
+static int parport_writer_wait(struct parport_dev *pp) {
+	struct parport_writer_s *w = &pp->writer;
+	int ret;
+
+	if (!w->running)
+		return 0;
+
+	pthread_mutex_lock(&w->lock);
+	while (w->nqueue || w->busy)
+		pthread_cond_wait(&w->cond, &w->lock);
+	ret = w->ret;
+	w->ret = 0;
+	pthread_mutex_unlock(&w->lock);
+
+	return ret;
+}
+
+static void parport_writer_stop(struct parport_dev *pp) {
+	if (!pp->writer.running)
+		return;
+
+	parport_writer_wait(pp);
+
+	pthread_mutex_lock(&pp->writer.lock);
+	pp->writer.stop = 1;
+	pthread_cond_broadcast(&pp->writer.cond);
+	pthread_mutex_unlock(&pp->writer.lock);
+
+	pthread_join(pp->writer.thread, NULL);
+	pthread_cond_destroy(&pp->writer.cond);
+	pthread_mutex_destroy(&pp->writer.lock);
+	free(pp->writer.queue);
+	pp->writer.running = 0;
+}
+
+static int parport_writer_queue(struct parport_dev *pp, WD_TRANSFER *tr, int num) {
+	struct parport_writer_s *w = &pp->writer;
+	unsigned char *queue;
+	int i, size;
+
+	pthread_mutex_lock(&w->lock);
+
+	/* don't run too far ahead of the port */
+	while (w->nqueue && w->nqueue + num > PARPORT_QUEUE_MAX)
+		pthread_cond_wait(&w->cond, &w->lock);
+
+	if (w->nqueue + num > w->size) {
+		size = w->size ? w->size : 4096;
+		while (size < w->nqueue + num)
+			size *= 2;
+
+		if (!(queue = realloc(w->queue, size))) {
+			pthread_mutex_unlock(&w->lock);
+			return -ENOMEM;
+		}
+
+		w->queue = queue;
+		w->size = size;
+	}
+
+	for (i = 0; i < num; i++)
+		w->queue[w->nqueue++] = tr[i].Data.Byte;
+
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	return 0;
+}
+
+/* EPP address and data register */
+static int parport_epp(struct parport_dev *pp, int reg, int rd, unsigned char *val) {
+#ifdef PARPORT_DIRECT
+	if (pp->iobase) {
+		if (rd)
+			*val = inb(pp->iobase + reg);
+		else
+			outb(*val, pp->iobase + reg);
+
+		return 0;
+	}
+#endif
+
+	/* runs of data writes go out with a single write() */
+	if (!rd && reg == PP_EPP_DATA) {
+		if (parport_set_mode(pp, IEEE1284_MODE_EPP) != 0)
+			return -1;
+
+		return parport_queue(pp, *val);
+	}
+
+	return parport_rw(pp, IEEE1284_MODE_EPP, reg == PP_EPP_ADDR, rd, val);
+}
+
+/*
+ * ECP registers. With ppdev the mode impact selects in the ECR is
+ * negotiated and the FIFO is fed through write(), the kernel driver
+ * then uses the FIFO of the chip. The FIFO looks empty to impact, as
+ * everything collected is sent before a register is read.
+ */
+static int parport_ecp(struct parport_dev *pp, int reg, int rd, unsigned char *val) {
+	int mode = ECR_MODE(pp->ecr);
+
+#ifdef PARPORT_DIRECT
+	if (pp->iobase) {
+		int polls = PARPORT_FIFO_POLLS;
+
+		if (!pp->ecpio)
+			return 0;
+
+		if (rd) {
+			*val = inb(pp->ecpio + reg);
+			return 0;
+		}
+
+		if (reg == PP_ECP_ECR) {
+			pp->ecr = *val;
+			pp->data_valid = 0;
+			pp->control_valid = 0;
+		} else if (reg == PP_ECP_CFGA && (mode == ECR_PPF || mode == ECR_ECP)) {
+			while ((inb(pp->ecpio + PP_ECP_ECR) & 0x02) && --polls);
+			if (!polls) {
+				fprintf(stderr, "parport FIFO stays full\n");
+				return -1;
+			}
+		}
+
+		outb(*val, pp->ecpio + reg);
+
+		return 0;
+	}
+#endif
+
+	switch (reg) {
+		case PP_ECP_ECR:
+			if (rd) {
+				if (parport_flush(pp) != 0)
+					return -1;
+
+				*val = (pp->ecr & 0xfc) | 0x01;
+				return 0;
+			}
+
+			pp->ecr = *val;
+
+			switch (ECR_MODE(*val)) {
+				case ECR_SPP:
+				case ECR_PS2:
+				case ECR_PPF:
+					return parport_set_mode(pp, IEEE1284_MODE_COMPAT);
+				case ECR_ECP:
+					return parport_set_mode(pp, IEEE1284_MODE_ECP);
+				case ECR_EPP:
+					return parport_set_mode(pp, IEEE1284_MODE_EPP);
+			}
+			break;
+
+		case PP_ECP_CFGA:
+			/* cnfgA: 8 bit implementation, no interrupt pending */
+			if (mode == ECR_CNF) {
+				if (rd)
+					*val = 0x10;
+				break;
+			}
+
+			if (mode != ECR_PPF && mode != ECR_ECP)
+				break;
+
+			if (rd)
+				return parport_rw(pp, pp->mode, 0, 1, val);
+
+			return parport_queue(pp, *val);
+
+		case PP_ECP_CFGB:
+			if (rd)
+				*val = pp->cfgb;
+			else
+				pp->cfgb = *val;
+			break;
+	}
+
+	return 0;
+}
 
 int parport_transfer(WD_TRANSFER *tr, int fd, unsigned int request, int ppbase, int ecpbase, int num) {
+	struct parport_dev *pp;
 	int ret = 0;
 	int i;
 	unsigned long port;
 	unsigned char val;
-	static unsigned char last_pp_write = 0;
 
-	if (parportfd < 0)
+	/* The port number is encoded in the (virtual) I/O address */
+	if (ppbase / 0x10 >= CONFIG_MAX_PORTS || !(pp = ports[ppbase / 0x10]))
 		return ret;
 
-	if (ioctl(parportfd, PPCLAIM) == -1)
-		return -1;
+	/* Only ppdev data writes in SPP mode are worth a thread */
+	if (!pp->iobase && ECR_MODE(pp->ecr) <= ECR_PS2 && num > 0) {
+		for (i = 0; i < num; i++) {
+			if (tr[i].cmdTrans != PP_WRITE || (unsigned long)tr[i].dwPort != ppbase + PP_DATA)
+				break;
+		}
+
+		if (i == num && parport_writer_start(pp) == 0) {
+			DPRINTF("queueing %d data port writes\n", num);
+			return parport_writer_queue(pp, tr, num);
+		}
+	}
+
+	if ((ret = parport_writer_wait(pp)) != 0)
+		return ret;
 
 	for (i = 0; i < num; i++) {
 		DPRINTF("dwPort: 0x%lx, cmdTrans: %lu, dwbytes: %ld, fautoinc: %ld, dwoptions: %ld\n",
@@ -47,8 +517,13 @@ int parport_transfer(WD_TRANSFER *tr, int fd, unsigned int request, int ppbase,
 					break;
 
 				case PP_WRITE:
-					ret = ioctl(parportfd, PPWDATA, &val);
-					last_pp_write = val;
+					/* in ECP mode the data register is the command FIFO */
+					if (!pp->iobase && ECR_MODE(pp->ecr) == ECR_ECP) {
+						ret = parport_rw(pp, IEEE1284_MODE_ECP, 1, 0, &val);
+						break;
+					}
+
+					ret = parport_write_data(pp, val);
 					break;
 
 				default:
@@ -57,13 +532,13 @@ int parport_transfer(WD_TRANSFER *tr, int fd, unsigned int request, int ppbase,
 					break;
 			}
 		} else if (port == ppbase + PP_STATUS) {
-			DPRINTF("status port (last write: %d)\n", last_pp_write);
+			DPRINTF("status port (last write: %d)\n", pp->last_pp_write);
 			switch(tr[i].cmdTrans) {
 				case PP_READ:
-					ret = ioctl(parportfd, PPRSTATUS, &val);
+					ret = parport_read(pp, PP_STATUS, &val);
 #ifdef FORCE_PC3_IDENT
 					val &= 0x5f;
-					if (last_pp_write & 0x40)
+					if (pp->last_pp_write & 0x40)
 						val |= 0x20;
 					else
 						val |= 0x80;
@@ -83,11 +558,18 @@ int parport_transfer(WD_TRANSFER *tr, int fd, unsigned int request, int ppbase,
 			DPRINTF("control port\n");
 			switch(tr[i].cmdTrans) {
 				case PP_READ:
-					ret = ioctl(parportfd, PPRCONTROL, &val);
+					ret = parport_read(pp, PP_CONTROL, &val);
 					break;
 
 				case PP_WRITE:
-					ret = ioctl(parportfd, PPWCONTROL, &val);
+					if (pp->control_valid && val == pp->last_control) {
+						ret = 0;
+						break;
+					}
+
+					ret = parport_write(pp, PP_CONTROL, val);
+					pp->last_control = val;
+					pp->control_valid = (ret == 0);
 					break;
 
 				default:
@@ -95,12 +577,22 @@ int parport_transfer(WD_TRANSFER *tr, int fd, unsigned int request, int ppbase,
 					ret = -1;
 					break;
 			}
-		} else if ((port == ecpbase + PP_ECP_CFGA) && ecpbase) {
-			DPRINTF("ECP_CFGA port\n");
-		} else if ((port == ecpbase + PP_ECP_CFGB) && ecpbase) {
-			DPRINTF("ECP_CFGB port\n");
-		} else if ((port == ecpbase + PP_ECP_ECR) && ecpbase) {
-			DPRINTF("ECP_ECR port\n");
+		} else if ((port == ppbase + PP_EPP_ADDR) || (port == ppbase + PP_EPP_DATA)) {
+			DPRINTF("EPP %s port\n", (port == ppbase + PP_EPP_ADDR) ? "address" : "data");
+			if ((tr[i].cmdTrans == PP_READ) || (tr[i].cmdTrans == PP_WRITE)) {
+				ret = parport_epp(pp, port - ppbase, tr[i].cmdTrans == PP_READ, &val);
+			} else {
+				fprintf(stderr,"!!!Unsupported TRANSFER command: %lu!!!\n", tr[i].cmdTrans);
+				ret = -1;
+			}
+		} else if (ecpbase && (port >= ecpbase + PP_ECP_CFGA) && (port <= ecpbase + PP_ECP_ECR)) {
+			DPRINTF("ECP port %lu\n", port - ecpbase);
+			if ((tr[i].cmdTrans == PP_READ) || (tr[i].cmdTrans == PP_WRITE)) {
+				ret = parport_ecp(pp, port - ecpbase, tr[i].cmdTrans == PP_READ, &val);
+			} else {
+				fprintf(stderr,"!!!Unsupported TRANSFER command: %lu!!!\n", tr[i].cmdTrans);
+				ret = -1;
+			}
 		} else {
 			DPRINTF("access to unsupported address range!\n");
 			ret = 0;
@@ -117,58 +609,142 @@ int parport_transfer(WD_TRANSFER *tr, int fd, unsigned int request, int ppbase,
 #endif
 	}
 
-	ioctl(parportfd, PPRELEASE);
+	if (parport_flush(pp) != 0)
+		ret = -1;
 
 	return ret;
 }
 
-int parport_open(int num) {
-	char ppdev[32];
+#ifdef PARPORT_DIRECT
+/* Get access to the registers of parportN, the kernel knows its address */
+static int parport_open_direct(struct parport_dev *pp, int num) {
+	unsigned long iobase = config_pport_iobase(num);
+	unsigned long ecpio = iobase ? iobase + 0x400 : 0;
+	char path[64], buf[64];
+	ssize_t len;
+	int fd;
 
-	if (parportfd < 0) {
-		snprintf(ppdev, sizeof(ppdev), "/dev/parport%u", num);
-		DPRINTF("opening %s\n", ppdev);
-		parportfd = open(ppdev, O_RDWR|O_EXCL);
+	/* not with fopen(), impact gets faked base-addr files from there */
+	if (!iobase) {
+		snprintf(path, sizeof(path), "/proc/sys/dev/parport/parport%d/base-addr", num);
+		if ((fd = open(path, O_RDONLY)) >= 0) {
+			len = read(fd, buf, sizeof(buf) - 1);
+			buf[len > 0 ? len : 0] = '\0';
+			if (sscanf(buf, "%lu %lu", &iobase, &ecpio) < 1)
+				iobase = 0;
+			close(fd);
+		}
+	}
 
-		if (parportfd < 0)
-			fprintf(stderr,"Can't open %s: %s\n", ppdev, strerror(errno));
+	if (!iobase) {
+		fprintf(stderr, "Can't find the I/O address of parport%d, using ppdev\n", num);
+		return -1;
 	}
 
-	if (parportfd >= 0) {
-		int pmode;
+	if (ioperm(iobase, PARPORT_REGS, 1) == -1) {
+		fprintf(stderr, "Can't access I/O ports 0x%lx-0x%lx: %s, using ppdev\n",
+				iobase, iobase + PARPORT_REGS - 1, strerror(errno));
+		return -1;
+	}
 
-		if (ioctl(parportfd, PPCLAIM) == -1)
-			return -1;
+	/* without ECP registers their accesses are ignored, as with ppdev before */
+	if (ecpio && ioperm(ecpio, PARPORT_ECP_REGS, 1) == -1)
+		ecpio = 0;
 
-		pmode = IEEE1284_MODE_COMPAT;
-		if (ioctl(parportfd, PPNEGOT, &pmode) == -1)
-			return -1;
+	pp->iobase = iobase;
+	pp->ecpio = ecpio;
+	pp->fd = PARPORT_DIRECT_HANDLE(num);
 
-		ioctl(parportfd, PPRELEASE);
-#if 0
-		if (cr->Card.dwItems > 1 && cr->Card.Item[1].I.IO.dwAddr) {
-			DPRINTF("ECP mode requested\n");
-			ecpbase = (unsigned long)cr->Card.Item[1].I.IO.dwAddr;
-			/* TODO: Implement ECP mode */
-			pmode = IEEE1284_MODE_ECP;
-
-			if (ioctl(parportfd, PPNEGOT, &pmode) == -1) {
-				ecpbase = 0;
-				pmode = IEEE1284_MODE_COMPAT;
-				if (ioctl(parportfd, PPNEGOT, &pmode) == -1)
-					return ret;
-			}
+	/* forward direction, as ppdev does in compatibility mode */
+	pp->ctr = inb(iobase + PP_CONTROL) & ~0x20;
+	outb(pp->ctr, iobase + PP_CONTROL);
+
+	if (ecpio)
+		pp->ecr = inb(ecpio + PP_ECP_ECR);
+
+	DPRINTF("parport%d at 0x%lx (ECP 0x%lx) with direct port I/O\n", num, iobase, ecpio);
+
+	return 0;
+}
+#endif
+
+int parport_open(int num) {
+	struct parport_dev *pp;
+	const char *ppdev;
+	char path[32];
+	int pmode;
+
+	if (num < 0 || num >= CONFIG_MAX_PORTS)
+		return -1;
+
+	if (ports[num])
+		return ports[num]->fd;
+
+	/* LPTn = PPDEV:<device> maps the port to any other ppdev device */
+	if (!(ppdev = config_pport_device(num))) {
+		snprintf(path, sizeof(path), "/dev/parport%u", num);
+		ppdev = path;
+	}
+	DPRINTF("opening %s\n", ppdev);
+
+	if (!(pp = calloc(1, sizeof(struct parport_dev))))
+		return -1;
+
+	if (config_pport_direct(num)) {
+#ifdef PARPORT_DIRECT
+		if (parport_open_direct(pp, num) == 0) {
+			ports[num] = pp;
+			return pp->fd;
 		}
+#else
+		fprintf(stderr, "Direct port I/O is not supported on this architecture, using ppdev\n");
 #endif
 	}
 
-	return parportfd;
+	pp->fd = open(ppdev, O_RDWR|O_EXCL);
+	if (pp->fd < 0) {
+		fprintf(stderr,"Can't open %s: %s\n", ppdev, strerror(errno));
+		free(pp);
+		return -1;
+	}
+
+	/* Claimed until parport_close() */
+	pmode = IEEE1284_MODE_COMPAT;
+	if ((ioctl(pp->fd, PPCLAIM) == -1) || (ioctl(pp->fd, PPNEGOT, &pmode) == -1)) {
+		close(pp->fd);
+		free(pp);
+		return -1;
+	}
+
+	/* ECP and EPP are entered when impact selects them, see parport_ecp() */
+	pp->mode = pmode;
+
+	ports[num] = pp;
+
+	return pp->fd;
 }
 
 void parport_close(int handle) {
-	if (parportfd == handle && parportfd >= 0) {
-		ioctl(parportfd, PPRELEASE);
-		close(parportfd);
-		parportfd = -1;
+	int i;
+
+	for (i = 0; i < CONFIG_MAX_PORTS; i++) {
+		if (ports[i] && ports[i]->fd == handle) {
+			parport_writer_stop(ports[i]);
+
+			if (ports[i]->iobase) {
+#ifdef PARPORT_DIRECT
+				ioperm(ports[i]->iobase, PARPORT_REGS, 0);
+				if (ports[i]->ecpio)
+					ioperm(ports[i]->ecpio, PARPORT_ECP_REGS, 0);
+#endif
+			} else {
+				parport_set_mode(ports[i], IEEE1284_MODE_COMPAT);
+				ioctl(handle, PPRELEASE);
+				close(handle);
+			}
+			free(ports[i]);
+			ports[i] = NULL;
+			break;
+		}
 	}
 }
@@ -0,0 +1,211 @@
+/* Dormant front end of libusb-driver
+ *
+ * This is the library which is preloaded into every process. It only
+ * depends on libc and passes all calls through until the process turns out
+ * to be a WinDriver client, i.e. it opens /dev/windrvr6, reads /proc/modules
+ * or is impact. The real driver (usb-driver.c and the cable backends with
+ * libusb and libftdi) is then loaded from the directory of this library and
+ * gets all these calls from then on. The driver also exports the XIL_IMPACT_
+ * variables when it is loaded, so other processes start up untouched.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include "usb-driver.h"
+
+#ifndef CORE_LIB
+#define CORE_LIB "libusb-driver-core.so"
+#endif
+
+struct core {
+	int (*ioctl) (int, unsigned long int, ...);
+	int (*open) (const char *, int, ...);
+	int (*close) (int);
+	FILE* (*fopen) (const char*, const char*);
+	int (*access) (const char*, int);
+	long int (*is_module_loaded) (char *, int);
+	void* (*port_resources) (void);
+};
+
+static struct core core_funcs;
+static struct core *core = NULL;	/* set once the driver is loaded */
+static pthread_once_t core_once = PTHREAD_ONCE_INIT;
+
+static inline struct core *active(void) {
+	return __atomic_load_n(&core, __ATOMIC_ACQUIRE);
+}
+
+/* The driver is not preloaded, it finds the libc functions through us */
+static void *next_sym(const char *name) {
+	return dlsym(RTLD_NEXT, name);
+}
+
+static void core_load(void) {
+	void (*set_next) (void *(*) (const char *));
+	char path[PATH_MAX];
+	Dl_info info;
+	char *dir;
+	void *h;
+
+	snprintf(path, sizeof(path), "%s", CORE_LIB);
+	if (dladdr((void*)core_load, &info) && info.dli_fname && (dir = strrchr(info.dli_fname, '/')))
+		snprintf(path, sizeof(path), "%.*s/%s", (int)(dir - info.dli_fname), info.dli_fname, CORE_LIB);
+
+	DPRINTF("WinDriver client, loading %s\n", path);
+
+	if (!(h = dlopen(path, RTLD_NOW | RTLD_LOCAL))) {
+		fprintf(stderr, "libusb-driver.so: Can't load %s: %s\n", path, dlerror());
+		return;
+	}
+
+	if ((set_next = (void (*) (void *(*) (const char *))) dlsym(h, "libusbdriver_set_next")))
+		set_next(next_sym);
+
+	core_funcs.ioctl = (int (*) (int, unsigned long int, ...)) dlsym(h, "ioctl");
+	core_funcs.open = (int (*) (const char *, int, ...)) dlsym(h, "open");
+	core_funcs.close = (int (*) (int)) dlsym(h, "close");
+	core_funcs.fopen = (FILE* (*) (const char*, const char*)) dlsym(h, "fopen");
+	core_funcs.access = (int (*) (const char*, int)) dlsym(h, "access");
+	core_funcs.is_module_loaded = (long int (*) (char *, int)) dlsym(h, "_Z14isModuleLoadedPci");
+	core_funcs.port_resources = (void* (*) (void)) dlsym(h, "_ZN9XilCommNS14CPortResources8InstanceEv");
+
+	if (!set_next || !core_funcs.ioctl || !core_funcs.open || !core_funcs.close ||
+			!core_funcs.fopen || !core_funcs.access || !core_funcs.is_module_loaded || !core_funcs.port_resources) {
+		fprintf(stderr, "libusb-driver.so: %s is not a libusb-driver core\n", path);
+		dlclose(h);
+		return;
+	}
+
+	__atomic_store_n(&core, &core_funcs, __ATOMIC_RELEASE);
+}
+
+static struct core *activate(void) {
+	pthread_once(&core_once, core_load);
+
+	return active();
+}
+
+int ioctl(int fd, unsigned long int request, ...) {
+	static int (*func) (int, unsigned long int, ...) = NULL;
+	struct core *c = active();
+	va_list args;
+	void *argp;
+
+	va_start (args, request);
+	argp = va_arg (args, void *);
+	va_end (args);
+
+	if (c)
+		return c->ioctl(fd, request, argp);
+
+	if (!func)
+		func = (int (*) (int, unsigned long int, ...)) dlsym (RTLD_NEXT, "ioctl");
+
+	return (*func) (fd, request, argp);
+}
+
+int open (const char *pathname, int flags, ...) {
+	static int (*func) (const char *, int, ...) = NULL;
+	struct core *c = active();
+	mode_t mode = 0;
+	va_list args;
+
+	if (flags & O_CREAT) {
+		va_start(args, flags);
+		mode = va_arg(args, mode_t);
+		va_end(args);
+	}
+
+	if (!c && !strcmp(pathname, "/dev/windrvr6"))
+		c = activate();
+
+	if (c)
+		return c->open(pathname, flags, mode);
+
+	if (!func)
+		func = (int (*) (const char *, int, ...)) dlsym (RTLD_NEXT, "open");
+
+	return (*func) (pathname, flags, mode);
+}
+
+int close(int fd) {
+	static int (*func) (int) = NULL;
+	struct core *c = active();
+
+	if (c)
+		return c->close(fd);
+
+	if (!func)
+		func = (int (*) (int)) dlsym(RTLD_NEXT, "close");
+
+	return (*func) (fd);
+}
+
+FILE *fopen(const char *path, const char *mode) {
+	static FILE* (*func) (const char*, const char*) = NULL;
+	struct core *c = active();
+
+	if (!c && !strcmp(path, "/proc/modules"))
+		c = activate();
+
+	if (c)
+		return c->fopen(path, mode);
+
+	if (!func)
+		func = (FILE* (*) (const char*, const char*)) dlsym(RTLD_NEXT, "fopen");
+
+	return (*func) (path, mode);
+}
+
+int access(const char *pathname, int mode) {
+	static int (*func) (const char*, int) = NULL;
+	struct core *c = active();
+
+	if (!c && pathname && !strcmp(pathname, "/dev/windrvr6"))
+		c = activate();
+
+	if (c)
+		return c->access(pathname, mode);
+
+	if (!func)
+		func = (int (*) (const char*, int)) dlsym(RTLD_NEXT, "access");
+
+	return (*func) (pathname, mode);
+}
+
+/* Only impact has these, see usb-driver.c */
+long int _Z14isModuleLoadedPci(char *module_name, int i) {
+	static long int (*func) (char *, int) = NULL;
+	struct core *c = activate();
+
+	if (c)
+		return c->is_module_loaded(module_name, i);
+
+	if (!func)
+		func = (long int (*) (char *, int)) dlsym(RTLD_NEXT, "_Z14isModuleLoadedPci");
+
+	return func ? (*func) (module_name, i) : 1;
+}
+
+void* _ZN9XilCommNS14CPortResources8InstanceEv() {
+	static void* (*func) (void) = NULL;
+	struct core *c = activate();
+
+	if (c)
+		return c->port_resources();
+
+	if (!func)
+		func = (void* (*) (void)) dlsym(RTLD_NEXT, "_ZN9XilCommNS14CPortResources8InstanceEv");
+
+	return (*func) ();
+}
@@ -33,15 +33,16 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <stdio.h>
-#include <signal.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
 #include <bits/wordsize.h>
 #include <sys/ipc.h>
 #include <sys/sem.h>
 #include <sys/mman.h>
+#include <link.h>
 #include <syscall.h>
 #include <linux/personality.h>
 #include "usb-driver.h"
@@ -49,18 +50,128 @@
 #include "xpcu.h"
 
 static int (*ioctl_func) (int, int, void *) = NULL;
-static int *windrvrfds = NULL;
-static int windrvrfds_count = 0;
-static unsigned long ppbase = 0;
-static unsigned long ecpbase = 0;
-static struct parport_config *pport = NULL;
-static FILE *modulesfp = NULL;
-static FILE *baseaddrfp = NULL;
-static int baseaddrnum = 0;
-static int modules_read = 0;
+static void *(*next_sym) (const char *name) = NULL;
+/*
+ * Opened windrvr6 fds, one bit per fd. ioctl() is called for every fd of
+ * the process, so checking an fd is a single atomic load; open() and
+ * close() set and clear the bits atomically from any thread.
+ */
+#define WINDRVR_MAXFD 65536
+#define WINDRVR_FDBITS (8 * sizeof(unsigned long))
+
+static unsigned long windrvrfds[WINDRVR_MAXFD / WINDRVR_FDBITS];
+
+static int is_windrvrfd(int fd) {
+	if (fd < 0 || fd >= WINDRVR_MAXFD)
+		return 0;
+
+	return (__atomic_load_n(&windrvrfds[fd / WINDRVR_FDBITS], __ATOMIC_ACQUIRE) >> (fd % WINDRVR_FDBITS)) & 1;
+}
+
 
 #define NO_WINDRVR 1
 
+/*
+ * A parallel port registered with CARD_REGISTER, by port number. Transfers
+ * hold a reference and the lock of their card only, so different cables
+ * can be used from several threads at once. cards_lock protects the
+ * table and the reference counts and is never held while waiting for a
+ * card. Registering and unregistering wait until the references are gone.
+ */
+struct card {
+	struct parport_config *pport;
+	unsigned long ppbase;
+	unsigned long ecpbase;
+	int handle;			/* of the backend, see CARD_HANDLE() */
+	int refs;			/* transfers using the card */
+	int busy;			/* being registered or unregistered */
+	pthread_cond_t idle;		/* refs or busy dropped */
+	pthread_mutex_t lock;		/* serialises the transfers */
+};
+
+static struct card cards[CONFIG_MAX_PORTS] = {
+	[0 ... CONFIG_MAX_PORTS-1] = {
+		.idle = PTHREAD_COND_INITIALIZER,
+		.lock = PTHREAD_MUTEX_INITIALIZER
+	}
+};
+static pthread_mutex_t cards_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the backends open and close their devices one at a time */
+static pthread_mutex_t cards_open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The backends hand out handles which can collide (a ppdev fd can have any
+ * number), impact gets the table index + 1 as hCard instead.
+ */
+#define CARD_HANDLE(num)	((num) + 1)
+#define CARD_NUM(hcard)		((long)(hcard) - 1)
+
+/* Find the registered card an I/O address belongs to, it is returned locked */
+static struct card *card_get(unsigned long port) {
+	struct card *card = NULL;
+	int i;
+
+	pthread_mutex_lock(&cards_lock);
+	for (i = 0; i < CONFIG_MAX_PORTS; i++) {
+		if (!cards[i].pport || cards[i].busy)
+			continue;
+
+		if (((port >= cards[i].ppbase) && (port < cards[i].ppbase + 0x10)) ||
+				(cards[i].ecpbase && (port >= cards[i].ecpbase) && (port < cards[i].ecpbase + 0x10))) {
+			card = &(cards[i]);
+			card->refs++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cards_lock);
+
+	if (card)
+		pthread_mutex_lock(&card->lock);
+
+	return card;
+}
+
+static void card_put(struct card *card) {
+	pthread_mutex_unlock(&card->lock);
+
+	pthread_mutex_lock(&cards_lock);
+	if (--card->refs == 0)
+		pthread_cond_broadcast(&card->idle);
+	pthread_mutex_unlock(&cards_lock);
+}
+
+/* Keep transfers away from the card, called with cards_lock held */
+static void card_claim(struct card *card) {
+	while (card->busy)
+		pthread_cond_wait(&card->idle, &cards_lock);
+
+	card->busy = 1;
+
+	while (card->refs)
+		pthread_cond_wait(&card->idle, &cards_lock);
+}
+
+static void card_release(struct card *card) {
+	card->busy = 0;
+	pthread_cond_broadcast(&card->idle);
+}
+
+/*
+ * Called by usb-driver-shim.c, which loads this library only in WinDriver
+ * clients. RTLD_NEXT doesn't work from a dlopen()ed library, so the shim
+ * looks the libc functions up for us.
+ */
+void libusbdriver_set_next(void *(*func) (const char *name)) {
+	next_sym = func;
+}
+
+static void *libc_sym(const char *name) {
+	if (next_sym)
+		return next_sym(name);
+
+	return dlsym(RTLD_NEXT, name);
+}
+
 void hexdump(unsigned char *buf, int len, char *prefix) {
 	int i = 0;
 
@@ -118,23 +229,44 @@ static int do_wdioctl(int fd, unsigned int request, unsigned char *wdioctl) {
 #ifndef NO_WINDRVR
 				ret = (*ioctl_func) (fd, request, wdioctl);
 #else
-				cr->hCard = 0;
+				{
+					unsigned long num = (unsigned long)cr->Card.Item[0].I.IO.dwAddr / 0x10;
+					struct parport_config *pport;
+					struct card *card;
 
-				pport = config_get((unsigned long)cr->Card.Item[0].I.IO.dwAddr / 0x10);
-				if (!pport)
-					break;
+					cr->hCard = 0;
 
-				ret = pport->open((unsigned long)cr->Card.Item[0].I.IO.dwAddr / 0x10);
+					if (num >= CONFIG_MAX_PORTS)
+						break;
 
-				ppbase = (unsigned long)cr->Card.Item[0].I.IO.dwAddr;
+					pport = config_get(num);
+					if (!pport)
+						break;
 
-				if (cr->Card.dwItems > 1 && cr->Card.Item[1].I.IO.dwAddr)
-					ecpbase = (unsigned long)cr->Card.Item[1].I.IO.dwAddr;
+					card = &(cards[num]);
+					pthread_mutex_lock(&cards_lock);
+					card_claim(card);
+					pthread_mutex_unlock(&cards_lock);
 
-				if (ret >= 0) {
-					cr->hCard = ret;
-				} else {
-					cr->hCard = 0;
+					pthread_mutex_lock(&cards_open_lock);
+					ret = pport->open(num);
+					pthread_mutex_unlock(&cards_open_lock);
+
+					if (ret >= 0) {
+						card->pport = pport;
+						card->ppbase = (unsigned long)cr->Card.Item[0].I.IO.dwAddr;
+						card->ecpbase = 0;
+
+						if (cr->Card.dwItems > 1 && cr->Card.Item[1].I.IO.dwAddr)
+							card->ecpbase = (unsigned long)cr->Card.Item[1].I.IO.dwAddr;
+
+						card->handle = ret;
+						cr->hCard = CARD_HANDLE(num);
+					}
+
+					pthread_mutex_lock(&cards_lock);
+					card_release(card);
+					pthread_mutex_unlock(&cards_lock);
 				}
 #endif
 				DPRINTF("<-hCard: %lu\n", cr->hCard);
@@ -313,7 +445,14 @@ static int do_wdioctl(int fd, unsigned int request, unsigned char *wdioctl) {
 #ifndef NO_WINDRVR
 				ret = (*ioctl_func) (fd, request, wdioctl);
 #else
-				ret = pport->transfer(tr, fd, request, ppbase, ecpbase, 1);
+				struct card *card = card_get((unsigned long)tr->dwPort);
+
+				if (card) {
+					ret = card->pport->transfer(tr, fd, request, card->ppbase, card->ecpbase, 1);
+					card_put(card);
+				} else {
+					ret = -ENODEV;
+				}
 #endif
 			}
 			break;
@@ -327,7 +466,15 @@ static int do_wdioctl(int fd, unsigned int request, unsigned char *wdioctl) {
 #ifndef NO_WINDRVR
 				ret = (*ioctl_func) (fd, request, wdioctl);
 #else
-				ret = pport->transfer(tr, fd, request, ppbase, ecpbase, num);
+				/* All transfers of one request go to the same card */
+				struct card *card = card_get((unsigned long)tr->dwPort);
+
+				if (card) {
+					ret = card->pport->transfer(tr, fd, request, card->ppbase, card->ecpbase, num);
+					card_put(card);
+				} else {
+					ret = -ENODEV;
+				}
 #endif
 			}
 			break;
@@ -383,10 +530,30 @@ static int do_wdioctl(int fd, unsigned int request, unsigned char *wdioctl) {
 #ifndef NO_WINDRVR
 				ret = (*ioctl_func) (fd, request, wdioctl);
 #else
-				if (pport)
-					pport->close(cr->hCard);
-
-				pport = NULL;
+				{
+					long i = CARD_NUM(cr->hCard);
+					struct parport_config *pport;
+
+					if (i < 0 || i >= CONFIG_MAX_PORTS)
+						break;
+
+					/* waits for the transfers in progress */
+					pthread_mutex_lock(&cards_lock);
+					card_claim(&(cards[i]));
+					pport = cards[i].pport;
+					cards[i].pport = NULL;
+					pthread_mutex_unlock(&cards_lock);
+
+					if (pport) {
+						pthread_mutex_lock(&cards_open_lock);
+						pport->close(cards[i].handle);
+						pthread_mutex_unlock(&cards_open_lock);
+					}
+
+					pthread_mutex_lock(&cards_lock);
+					card_release(&(cards[i]));
+					pthread_mutex_unlock(&cards_lock);
+				}
 #endif
 			}
 			break;
@@ -460,19 +627,16 @@ static int do_wdioctl(int fd, unsigned int request, unsigned char *wdioctl) {
 int ioctl(int fd, unsigned long int request, ...) {
 	va_list args;
 	void *argp;
-	int i;
 
 	if (!ioctl_func)                                                                    
-		ioctl_func = (int (*) (int, int, void *)) dlsym (RTLD_NEXT, "ioctl");             
+		ioctl_func = (int (*) (int, int, void *)) libc_sym("ioctl");             
 
 	va_start (args, request);
 	argp = va_arg (args, void *);
 	va_end (args);
 
-	for (i = 0; i < windrvrfds_count; i++) {
-		if (fd == windrvrfds[i])
-			return do_wdioctl(fd, request, argp);
-	}
+	if (is_windrvrfd(fd))
+		return do_wdioctl(fd, request, argp);
 
 	return (*ioctl_func) (fd, request, argp);
 }
@@ -484,7 +648,7 @@ int open (const char *pathname, int flags, ...) {
 	int fd;
 
 	if (!func)
-		func = (int (*) (const char *, int, mode_t)) dlsym (RTLD_NEXT, "open");
+		func = (int (*) (const char *, int, mode_t)) libc_sym("open");
 
 	if (flags & O_CREAT) {
 		va_start(args, flags);
@@ -493,16 +657,23 @@ int open (const char *pathname, int flags, ...) {
 	}
 
 	if (!strcmp (pathname, "/dev/windrvr6")) {
-		DPRINTF("opening windrvr6 (%d)\n", windrvrfds_count);
-		windrvrfds = realloc(windrvrfds, sizeof(int) * (++windrvrfds_count));
-		if (!windrvrfds)
-			return -ENOMEM;
-
 #ifdef NO_WINDRVR
-		windrvrfds[windrvrfds_count-1] = fd = (*func) ("/dev/null", flags, mode);
+		fd = (*func) ("/dev/null", flags, mode);
 #else
-		windrvrfds[windrvrfds_count-1] = fd = (*func) (pathname, flags, mode);
+		fd = (*func) (pathname, flags, mode);
 #endif
+		if (fd < 0)
+			return fd;
+
+		if (fd >= WINDRVR_MAXFD) {
+			fprintf(stderr, "libusb-driver.so: windrvr6 opened as fd %d, only %d are supported\n", fd, WINDRVR_MAXFD);
+			close(fd);
+			errno = EMFILE;
+			return -1;
+		}
+
+		DPRINTF("opening windrvr6 (%d)\n", fd);
+		__atomic_fetch_or(&windrvrfds[fd / WINDRVR_FDBITS], 1UL << (fd % WINDRVR_FDBITS), __ATOMIC_RELEASE);
 
 		return fd;
 	}
@@ -512,124 +683,81 @@ int open (const char *pathname, int flags, ...) {
 
 int close(int fd) {
 	static int (*func) (int) = NULL;
-	int i;
 
 	if (!func)
-		func = (int (*) (int)) dlsym(RTLD_NEXT, "close");
+		func = (int (*) (int)) libc_sym("close");
 	
-	for (i = 0; i < windrvrfds_count; i++) {
-		if (fd == windrvrfds[i] && windrvrfds[i] >= 0) {
-			int remaining = windrvrfds_count - (i + 1);
-			DPRINTF("close windrvr6 (%d)\n", i);
-			if (remaining)
-				memmove(&(windrvrfds[i]), &(windrvrfds[i+1]), remaining * sizeof(int));
-			windrvrfds = realloc(windrvrfds, sizeof(int) * --windrvrfds_count);
-			if (!windrvrfds_count)
-				windrvrfds = NULL;
-			break;
-		}
+	/* cleared before the fd number can be handed out again */
+	if (is_windrvrfd(fd)) {
+		DPRINTF("close windrvr6 (%d)\n", fd);
+		__atomic_fetch_and(&windrvrfds[fd / WINDRVR_FDBITS], ~(1UL << (fd % WINDRVR_FDBITS)), __ATOMIC_RELEASE);
 	}
 
 	return (*func) (fd);
 }
 
+/* A stream which reads text, for the /proc files impact looks at */
+static FILE *fake_file(const char *text) {
+	FILE *f;
+
+	if (!(f = fmemopen(NULL, strlen(text) + 1, "w+")))
+		return NULL;
+
+	fputs(text, f);
+	rewind(f);
+
+	return f;
+}
+
+/*
+ * /proc/modules and the base-addr files of the parallel ports are served
+ * from memory, all other files are opened by libc and read at full speed.
+ */
 FILE *fopen(const char *path, const char *mode) {
-	FILE *ret;
 	static FILE* (*func) (const char*, const char*) = NULL;
-	char buf[256];
-	int i;
+	static const char baseaddr[] = "/proc/sys/dev/parport/parport";
+	char buf[64];
+	char *end;
+	long num;
 
 	if (!func)
-		func = (FILE* (*) (const char*, const char*)) dlsym(RTLD_NEXT, "fopen");
-
-	for (i = 0; i < 4; i++) {
-		snprintf(buf, sizeof(buf), "/proc/sys/dev/parport/parport%d/base-addr", i);
-		if (!strcmp(path, buf)) {
-			DPRINTF("open base-addr of parport%d\n", i);
-			if (config_is_real_pport(i)) {
-				ret = (*func) (path, mode);
-			} else {
-				ret = (*func) ("/dev/null", mode);
-			}
-
-			if (ret) {
-				baseaddrfp = ret;
-				baseaddrnum = i;
-			}
-
-			return ret;
-		}
-	}
+		func = (FILE* (*) (const char*, const char*)) libc_sym("fopen");
 
-	ret = (*func) (path, mode);
+	if (strncmp(path, "/proc/", 6))
+		return (*func) (path, mode);
 
+#ifdef NO_WINDRVR
 	if (!strcmp(path, "/proc/modules")) {
 		DPRINTF("opening /proc/modules\n");
-		if (!ret && errno == ENOENT) {
-			/* Hmm.. there appears to be no /proc/modules file
-			 * fake it then */
-			ret = (*func)("/dev/null", mode);
-			DPRINTF("No /proc/modules -- faking\n");
-		}
-#ifdef NO_WINDRVR
-		modulesfp = ret;
-		modules_read = 0;
-#endif
+		return fake_file("windrvr6 1 0 - Live 0xdeadbeef\n"
+				"parport_pc 1 0 - Live 0xdeadbeef\n");
 	}
+#endif
 
-	return ret;
-}
+	if (strncmp(path, baseaddr, sizeof(baseaddr) - 1))
+		return (*func) (path, mode);
 
-char *fgets(char *s, int size, FILE *stream) {
-        static char* (*func) (char*, int, FILE*) = NULL;
-	const char modules[][256] = {"windrvr6 1 0 - Live 0xdeadbeef\n", "parport_pc 1 0 - Live 0xdeadbeef\n"};
-	char buf[256];
-	char *ret = NULL;
+	num = strtol(path + sizeof(baseaddr) - 1, &end, 10);
+	if (end == path + sizeof(baseaddr) - 1 || strcmp(end, "/base-addr") ||
+			num < 0 || num >= config_num_ports())
+		return (*func) (path, mode);
 
+	DPRINTF("open base-addr of parport%ld\n", num);
 
-	if (!func)
-		func = (char* (*) (char*, int, FILE*)) dlsym(RTLD_NEXT, "fgets");
-	
-	if (modulesfp == stream) {
-		if (modules_read < sizeof(modules) / sizeof(modules[0])) {
-			strcpy(s, modules[modules_read]);
-			ret = s;
-			modules_read++;
-		}
-	} else if (baseaddrfp == stream) {
-		snprintf(s, sizeof(buf), "%d\t%d\n",
-			(baseaddrnum) * 0x10,
-			((baseaddrnum) * 0x10) + 0x400);
-		ret = s;
-	} else {
-		ret = (*func)(s,size,stream);
-	}
+	/* the content is faked, but a real port has to exist */
+	if (config_is_real_pport(num) && !config_pport_device(num) && access(path, R_OK) != 0)
+		return NULL;
 
-	return ret;
-}
+	snprintf(buf, sizeof(buf), "%ld\t%ld\n", num * 0x10, (num * 0x10) + 0x400);
 
-int fclose(FILE *fp) {
-	static int (*func) (FILE*) = NULL;
-
-	if (!func)
-		func = (int (*) (FILE*)) dlsym(RTLD_NEXT, "fclose");
-
-	if (fp == modulesfp) {
-		modulesfp = NULL;
-	}
-
-	if (fp == baseaddrfp) {
-		baseaddrfp = NULL;
-	}
-	
-	return (*func)(fp);
+	return fake_file(buf);
 }
 
 int access(const char *pathname, int mode) {
 	static int (*func) (const char*, int);
 
 	if (!func)
-		func = (int (*) (const char*, int)) dlsym(RTLD_NEXT, "access");
+		func = (int (*) (const char*, int)) libc_sym("access");
 
 	if (pathname && !strcmp(pathname, "/dev/windrvr6")) {
 		return 0;
@@ -645,7 +773,7 @@ int semop (int __semid, struct sembuf *__sops, size_t __nsops) {
 	int i;
 
 	if (!func)
-		func = (int (*) (int, struct sembuf*, size_t)) dlsym(RTLD_NEXT, "semop");
+		func = (int (*) (int, struct sembuf*, size_t)) libc_sym("semop");
 	
 	fprintf(stderr,"semop: semid: 0x%X, elements: %d\n", __semid, __nsops);
 	for (i = 0; i < __nsops; i++) {
@@ -674,51 +802,160 @@ long int _Z14isModuleLoadedPci(char *module_name, int i) {
 	return 1;
 }
 
-void cpr_segv_handler(int sig, siginfo_t *info, void *context) {
-	void *newmem;
+/*
+ * CPortResources::Instance() reads the base address of the parallel ports
+ * from "/proc/sys/dev/parport/%s/base-addr", which has to be replaced with
+ * /dev/zero. The string is searched in the read-only segments of the
+ * library with the function, and its offset is cached per GNU build-id
+ * in ~/.libusb-driver-patches so the next start patches it right away.
+ */
+#define CPR_CACHE ".libusb-driver-patches"
+#define CPR_BUILD_ID_MAX 64
+
+static const char cpr_filename[] = "/proc/sys/dev/parport/%s/base-addr";
+
+struct cpr_search {
+	void *func;		/* the original CPortResources::Instance() */
+	char *filename;		/* the string to patch, if found */
+};
+
+/* The build-id of an object as a hex string, empty if it has none */
+static void cpr_build_id(struct dl_phdr_info *info, char *id, int len) {
+	const ElfW(Phdr) *ph;
+	const ElfW(Nhdr) *nh;
+	const unsigned char *p, *end, *desc;
+	int i, j;
+
+	id[0] = '\0';
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		ph = &(info->dlpi_phdr[i]);
+		if (ph->p_type != PT_NOTE)
+			continue;
+
+		p = (const unsigned char*)(info->dlpi_addr + ph->p_vaddr);
+		end = p + ph->p_memsz;
+
+		while (p + sizeof(ElfW(Nhdr)) <= end) {
+			nh = (const ElfW(Nhdr)*)p;
+			desc = p + sizeof(ElfW(Nhdr)) + ((nh->n_namesz + 3) & ~3);
+
+			if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 &&
+					!memcmp(p + sizeof(ElfW(Nhdr)), "GNU", 4) &&
+					desc + nh->n_descsz <= end && nh->n_descsz <= CPR_BUILD_ID_MAX) {
+				for (j = 0; j < nh->n_descsz && 2 * j + 2 < len; j++)
+					snprintf(id + 2 * j, 3, "%02x", desc[j]);
+				return;
+			}
 
-	DPRINTF("SEGV at %p, mapping memory\n", info->si_addr);
-	errno = 0;
-	newmem = mmap(info->si_addr, 1, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
-	if (newmem != info->si_addr) {
-		perror("libusb-driver.so: Can't map memory, crashing now");
-		exit(EXIT_FAILURE);
+			p = desc + ((nh->n_descsz + 3) & ~3);
+		}
 	}
 }
 
+static long cpr_cached(const char *id) {
+	char buf[256], name[2 * CPR_BUILD_ID_MAX + 1];
+	unsigned long offset;
+	long ret = -1;
+	FILE *cache;
+
+	snprintf(buf, sizeof(buf), "%s/" CPR_CACHE, getenv("HOME"));
+	if (!(cache = fopen(buf, "r")))
+		return -1;
+
+	while (fgets(buf, sizeof(buf), cache)) {
+		if (sscanf(buf, "%128s %lx", name, &offset) == 2 && !strcmp(name, id))
+			ret = offset;
+	}
+
+	fclose(cache);
+
+	return ret;
+}
+
+static void cpr_store(const char *id, unsigned long offset) {
+	char buf[256];
+	FILE *cache;
+
+	snprintf(buf, sizeof(buf), "%s/" CPR_CACHE, getenv("HOME"));
+	if (!(cache = fopen(buf, "a")))
+		return;
+
+	/* later entries win when reading */
+	fprintf(cache, "%s %lx\n", id, offset);
+	fclose(cache);
+}
+
+/* The read-only segment of the object with the offset, NULL if none */
+static const ElfW(Phdr) *cpr_segment(struct dl_phdr_info *info, unsigned long offset, size_t len) {
+	const ElfW(Phdr) *ph;
+	int i;
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		ph = &(info->dlpi_phdr[i]);
+		if (ph->p_type == PT_LOAD && !(ph->p_flags & PF_W) &&
+				offset >= ph->p_vaddr && offset + len <= ph->p_vaddr + ph->p_filesz)
+			return ph;
+	}
+
+	return NULL;
+}
+
+static int cpr_search_object(struct dl_phdr_info *info, size_t size, void *data) {
+	struct cpr_search *search = (struct cpr_search*)data;
+	unsigned long func = (unsigned long)search->func - info->dlpi_addr;
+	char id[2 * CPR_BUILD_ID_MAX + 1];
+	const ElfW(Phdr) *ph;
+	char *base = (char*)info->dlpi_addr;
+	long offset;
+	int i;
+
+	if (!cpr_segment(info, func, 1))
+		return 0;
+
+	cpr_build_id(info, id, sizeof(id));
+	DPRINTF("CPortResources::Instance() is in %s, build-id %s\n", info->dlpi_name, id[0] ? id : "none");
+
+	if (id[0] && (offset = cpr_cached(id)) >= 0 &&
+			cpr_segment(info, offset, sizeof(cpr_filename)) &&
+			!memcmp(base + offset, cpr_filename, sizeof(cpr_filename))) {
+		DPRINTF("Filename found at cached offset 0x%lx\n", offset);
+		search->filename = base + offset;
+		return 1;
+	}
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		ph = &(info->dlpi_phdr[i]);
+		if (ph->p_type != PT_LOAD || (ph->p_flags & PF_W))
+			continue;
+
+		search->filename = memmem(base + ph->p_vaddr, ph->p_filesz, cpr_filename, sizeof(cpr_filename));
+		if (search->filename) {
+			DPRINTF("Filename found at offset 0x%lx\n", (unsigned long)(search->filename - base));
+			if (id[0])
+				cpr_store(id, search->filename - base);
+			break;
+		}
+	}
+
+	return 1;
+}
+
 /* XilCommNS::CPortResources::Instance() */
 void* _ZN9XilCommNS14CPortResources8InstanceEv() {
 	static void* (*func) (void) = NULL;
+	struct cpr_search search;
 	char *filename = NULL;
 	void *ret;
-	int i;
 
 	if (!func) {
-		struct sigaction act, oldact;
-		int sighand_installed = 0;
+		func = (void* (*) (void)) libc_sym("_ZN9XilCommNS14CPortResources8InstanceEv");
 
-		func = (void* (*) (void)) dlsym(RTLD_NEXT, "_ZN9XilCommNS14CPortResources8InstanceEv");
+		search.func = (void*)func;
+		search.filename = NULL;
+		dl_iterate_phdr(cpr_search_object, &search);
 
-		DPRINTF("Installing signal-handler for SIGSEGV\n");
-		bzero(&act, sizeof(struct sigaction));
-		act.sa_sigaction = cpr_segv_handler;
-		act.sa_flags = SA_SIGINFO;
-		if (sigaction(SIGSEGV, &act, &oldact) == 0) {
-			sighand_installed = 1;
-		}
-
-		DPRINTF("Searching for filename starting at %p\n", func);
-		for(i = 0; i < 32768; i++) {
-			if (!strcmp(((char*)func)+i, "/proc/sys/dev/parport/%s/base-addr")) {
-				filename = ((char*)func)+i;
-				DPRINTF("Filename found at offset %p\n", (void*)(filename - ((char*)func)));
-				break;
-			}
-		}
-		if (sighand_installed) {
-			DPRINTF("Restoring signal-handler for SIGSEGV\n");
-			sigaction(SIGSEGV, &oldact, NULL);
-		}
+		filename = search.filename;
 		if (!filename)
 			fprintf(stderr, "libusb-driver.so: Can't find memory to patch, parallel cables will probably not work!\n");
 	}
@@ -767,7 +1004,7 @@ static void __attribute__ ((constructor)) libusbdriver_init(void) {
 	char buf[256];
 	char buf2[256];
 
-	for (i = 0; i < 4; i++) {
+	for (i = 0; i < config_num_ports(); i++) {
 		snprintf(buf, sizeof(buf), "XIL_IMPACT_ENV_LPT%d_BASE_ADDRESS", i+1);
 		snprintf(buf2, sizeof(buf2), "%x", 0x10*i);
 		setenv(buf, buf2, 1);
@@ -28,6 +28,8 @@
 #define PP_ECP_CFGA		0
 #define PP_ECP_CFGB		1
 #define PP_ECP_ECR		2
+#define PP_EPP_ADDR		3
+#define PP_EPP_DATA		4
 #define PP_READ			10
 #define PP_WRITE		13
 
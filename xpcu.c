@@ -9,13 +9,30 @@
 #include <stdint.h>
 #include "usb-driver.h"
 #include "xpcu.h"
+#ifdef JTAGKEY
+#include "config.h"
+#include "jtagkey.h"
+#endif
 
+/* One cable found with EVENT_REGISTER, its transfers are serialised */
 struct xpcu_s {
 	struct usb_device *dev;
 	usb_dev_handle *handle;
 	int interface;
 	int alternate;
+	int claimed;
 	unsigned long card_type;
+	pthread_mutex_t lock;
+#ifdef JTAGKEY
+	int ftdi;		/* emulated on an FTDI cable */
+	int ftdi_open;
+	unsigned char pins;
+	unsigned char *clk;
+	int clksize;
+	unsigned char *tdo;
+	int tdosize;
+	int tdolen;
+#endif
 };
 
 struct xpcu_event_s {
@@ -23,9 +40,17 @@ struct xpcu_event_s {
 	int count;
 	int interrupt_count;
 	pthread_mutex_t interrupt;
+	pthread_mutex_t lock;		/* interrupt_count */
 };
 
+/* The device list of libusb, shared by all events */
 static struct usb_bus *busses = NULL;
+static pthread_mutex_t busses_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef JTAGKEY
+/* All events present the same FTDI cable */
+static pthread_mutex_t ftdi_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 int xpcu_deviceinfo(struct usb_get_device_data *ugdd) {
 	struct xpcu_s *xpcu = (struct xpcu_s*)ugdd->dwUniqueID;
@@ -199,18 +224,17 @@ int xpcu_deviceinfo(struct usb_get_device_data *ugdd) {
 
 static int xpcu_claim(struct xpcu_s *xpcu, int claim) {
 	int ret = 0;
-	static int claimed = 0;
 
 	if (xpcu->interface < 0)
 		return -1;
 	
 	if (claim == XPCU_CLAIM) {
-		if (claimed)
+		if (xpcu->claimed)
 			return 0;
 
 		ret = usb_claim_interface(xpcu->handle, xpcu->interface);
 		if (!ret) {
-			claimed = 1;
+			xpcu->claimed = 1;
 			ret = usb_set_altinterface(xpcu->handle, xpcu->alternate);
 			if (ret)
 				fprintf(stderr, "usb_set_altinterface: %d\n", ret);
@@ -219,25 +243,299 @@ static int xpcu_claim(struct xpcu_s *xpcu, int claim) {
 					xpcu->interface, ret, usb_strerror());
 		}
 	} else {
-		if (!claimed)
+		if (!xpcu->claimed)
 			return 0;
 
 #if 0
 		ret = usb_release_interface(xpcu->handle, xpcu->interface);
 		if (!ret)
-			claimed = 0;
+			xpcu->claimed = 0;
 #endif
 	}
 
 	return ret;
 }
 
-int xpcu_transfer(struct usb_transfer *ut) {
-	struct xpcu_s *xpcu = (struct xpcu_s*)ut->dwUniqueID;
+#ifdef JTAGKEY
+/*
+ * Platform Cable USB emulation on FTDI cables ("XPCU = FTDI:..." in
+ * ~/.libusb-driverrc). Xilinx never documented the protocol, the vendor
+ * requests below are the ones known from other open source XPCU drivers:
+ *
+ * request 0xB0, value:
+ *	0x10/0x18	disable/enable the outputs
+ *	0x28		set speed (ignored, TCK runs at speed= of the XPCU statement)
+ *	0x30		write TDI (bit 0), TMS (bit 1) and TCK (bit 2) from index
+ *	0x38		read TDO (bit 0)
+ *	0x50		firmware (index 0) or CPLD (index 1) version
+ *	0xA6		shift, the vector follows on EP 2, TDO is read from EP 6
+ *
+ * Every 16 bit word of a shift vector describes 4 clocks: TDI in bits 0-3,
+ * TMS in bits 4-7, TCK enable in bits 8-11 and TDO capture in bits 12-15.
+ * Captured TDO bits are returned as 16 bit words, the bits of a partial
+ * last word are aligned to its MSB.
+ */
+#define XPCU_VID		0x03fd
+#define XPCU_PID		0x0008
+#define XPCU_FW_VERSION		0x0961
+#define XPCU_CPLD_VERSION	0x0012
+
+#define XPCU_GPIO_TDI		0x01
+#define XPCU_GPIO_TMS		0x02
+#define XPCU_GPIO_TCK		0x04
+
+static struct usb_endpoint_descriptor xpcu_ftdi_ep[] = {
+	{
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 0x02,
+		.bmAttributes = USB_ENDPOINT_TYPE_BULK,
+		.wMaxPacketSize = 512,
+	},
+	{
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 0x86,
+		.bmAttributes = USB_ENDPOINT_TYPE_BULK,
+		.wMaxPacketSize = 512,
+	},
+};
+
+static const struct usb_interface_descriptor xpcu_ftdi_alt = {
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bNumEndpoints = sizeof(xpcu_ftdi_ep) / sizeof(struct usb_endpoint_descriptor),
+	.endpoint = xpcu_ftdi_ep,
+};
+
+static const struct usb_config_descriptor xpcu_ftdi_config = {
+	.bLength = USB_DT_CONFIG_SIZE,
+	.bDescriptorType = USB_DT_CONFIG,
+	.bNumInterfaces = 1,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.MaxPower = 50,
+};
+
+static const struct usb_device xpcu_ftdi_dev = {
+	.filename = "ftdi",
+	.descriptor = {
+		.bLength = USB_DT_DEVICE_SIZE,
+		.bDescriptorType = USB_DT_DEVICE,
+		.bcdUSB = 0x0200,
+		.bMaxPacketSize0 = 64,
+		.idVendor = XPCU_VID,
+		.idProduct = XPCU_PID,
+		.bNumConfigurations = 1,
+	},
+};
+
+/* The virtual device of one event, dev has to come first for free() */
+struct xpcu_ftdi_desc {
+	struct usb_device dev;
+	struct usb_config_descriptor config;
+	struct usb_interface iface;
+	struct usb_interface_descriptor alt;
+};
+
+/* Make a virtual device which looks like what impact is searching for */
+static struct usb_device *xpcu_ftdi_device(WDU_MATCH_TABLE *match) {
+	struct xpcu_ftdi_desc *d;
+
+	if (!(d = malloc(sizeof(struct xpcu_ftdi_desc))))
+		return NULL;
+
+	d->dev = xpcu_ftdi_dev;
+	d->dev.config = &(d->config);
+	d->config = xpcu_ftdi_config;
+	d->config.interface = &(d->iface);
+	d->iface.altsetting = &(d->alt);
+	d->iface.num_altsetting = 1;
+	d->alt = xpcu_ftdi_alt;
+
+	d->dev.descriptor.bDeviceClass = match->bDeviceClass;
+	d->dev.descriptor.bDeviceSubClass = match->bDeviceSubClass;
+	d->alt.bInterfaceClass = match->bInterfaceClass;
+	d->alt.bInterfaceSubClass = match->bInterfaceSubClass;
+	d->alt.bInterfaceProtocol = match->bInterfaceProtocol;
+
+	return &(d->dev);
+}
+
+static int xpcu_ftdi_control(struct xpcu_s *xpcu, int requesttype, int request, int value, int index, unsigned char *buf, int size) {
 	int ret = 0;
 
-	if (!xpcu)
-		return -ENODEV;
+	/* answers of IN requests not filled in below read as 0 */
+	if (size && (requesttype & USB_ENDPOINT_IN))
+		bzero(buf, size);
+
+	if (request != 0xb0) {
+		DPRINTF("FTDI XPCU: unhandled request %x\n", request);
+		return size;
+	}
+
+	switch(value) {
+		case 0x10:
+			xpcu->pins |= JTAGKEY_OEn;
+			ret = jtagkey_set_pins(xpcu->pins);
+			break;
+
+		case 0x18:
+			xpcu->pins &= ~JTAGKEY_OEn;
+			ret = jtagkey_set_pins(xpcu->pins);
+			break;
+
+		case 0x30:
+			xpcu->pins &= JTAGKEY_OEn;
+			if (index & XPCU_GPIO_TDI)
+				xpcu->pins |= JTAGKEY_TDI;
+			if (index & XPCU_GPIO_TMS)
+				xpcu->pins |= JTAGKEY_TMS;
+			if (index & XPCU_GPIO_TCK)
+				xpcu->pins |= JTAGKEY_TCK;
+			ret = jtagkey_set_pins(xpcu->pins);
+			break;
+
+		case 0x38:
+			ret = jtagkey_get_pins();
+			if (ret >= 0 && size) {
+				buf[0] = (ret & JTAGKEY_TDO) ? 0x01 : 0x00;
+				ret = 0;
+			}
+			break;
+
+		case 0x50:
+			if (size >= 2) {
+				unsigned short version = index ? XPCU_CPLD_VERSION : XPCU_FW_VERSION;
+
+				buf[0] = version & 0xff;
+				buf[1] = (version >> 8) & 0xff;
+			}
+			break;
+
+		case 0xa6:
+			DPRINTF("FTDI XPCU: shift of %d bits\n", index);
+			break;
+
+		default:
+			DPRINTF("FTDI XPCU: ignoring value %x, index %x\n", value, index);
+			break;
+	}
+
+	if (ret < 0)
+		return ret;
+
+	return size;
+}
+
+static int xpcu_ftdi_shift(struct xpcu_s *xpcu, unsigned char *buf, int len) {
+	int nclk = 0, ntdo = 0;
+	int i, bit, ret;
+
+	if (xpcu->clksize < len * 2) {
+		unsigned char *clk = realloc(xpcu->clk, len * 2);
+
+		if (!clk)
+			return -ENOMEM;
+
+		xpcu->clk = clk;
+		xpcu->clksize = len * 2;
+	}
+
+	for (i = 0; i + 1 < len; i += 2) {
+		for (bit = 0; bit < 4; bit++) {
+			unsigned char c = 0x00;
+
+			if (!(buf[i+1] & (0x01 << bit)))
+				continue;
+
+			if (buf[i] & (0x01 << bit))
+				c |= JTAGKEY_TDI;
+			if (buf[i] & (0x10 << bit))
+				c |= JTAGKEY_TMS;
+			if (buf[i+1] & (0x10 << bit)) {
+				c |= JTAGKEY_TDO;
+				ntdo++;
+			}
+
+			xpcu->clk[nclk++] = c;
+		}
+	}
+
+	xpcu->tdolen = ((ntdo + 15) / 16) * 2;
+	if (!nclk)
+		return len;
+
+	if (xpcu->tdosize < xpcu->tdolen + nclk) {
+		unsigned char *tdo = realloc(xpcu->tdo, xpcu->tdolen + nclk);
+
+		if (!tdo)
+			return -ENOMEM;
+
+		xpcu->tdo = tdo;
+		xpcu->tdosize = xpcu->tdolen + nclk;
+	}
+
+	/* The sampled bits are collected behind the packed response */
+	if ((ret = jtagkey_shift(xpcu->clk, nclk, xpcu->tdo + xpcu->tdolen)) < 0)
+		return ret;
+
+	bzero(xpcu->tdo, xpcu->tdolen);
+	for (i = 0, bit = 0; i < nclk; i++) {
+		int pos = bit;
+
+		if (!(xpcu->clk[i] & JTAGKEY_TDO))
+			continue;
+
+		if ((ntdo % 16) && (bit >= ntdo - (ntdo % 16)))
+			pos += 16 - (ntdo % 16);
+
+		if (xpcu->tdo[xpcu->tdolen + i] & JTAGKEY_TDO)
+			xpcu->tdo[pos / 8] |= 1 << (pos % 8);
+
+		bit++;
+	}
+
+	return len;
+}
+
+static int xpcu_ftdi_transfer(struct xpcu_s *xpcu, struct usb_transfer *ut) {
+	int ret;
+
+	if (ut->dwPipeNum == 0) {
+		int requesttype, request, value, index, size;
+
+		requesttype = ut->SetupPacket[0];
+		request = ut->SetupPacket[1];
+		value = ut->SetupPacket[2] | (ut->SetupPacket[3] << 8);
+		index = ut->SetupPacket[4] | (ut->SetupPacket[5] << 8);
+		size = ut->SetupPacket[6] | (ut->SetupPacket[7] << 8);
+		DPRINTF("-> FTDI XPCU requesttype: %x, request: %x, value: %x, index: %u, size: %u\n", requesttype, request, value, index, size);
+		ret = xpcu_ftdi_control(xpcu, requesttype, request, value, index, ut->pBuffer, size);
+	} else if (ut->fRead) {
+		ret = xpcu->tdolen;
+		if (ret > ut->dwBufferSize)
+			ret = ut->dwBufferSize;
+
+		memcpy(ut->pBuffer, xpcu->tdo, ret);
+		xpcu->tdolen = 0;
+	} else {
+		ret = xpcu_ftdi_shift(xpcu, ut->pBuffer, ut->dwBufferSize);
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "FTDI XPCU transfer failed: %d\n", ret);
+	} else {
+		ut->dwBytesTransferred = ret;
+		ret = 0;
+	}
+
+	return ret;
+}
+#endif
+
+static int xpcu_usb_transfer(struct xpcu_s *xpcu, struct usb_transfer *ut) {
+	int ret = 0;
 
 	xpcu_claim(xpcu, XPCU_CLAIM);
 	/* http://www.jungo.com/support/documentation/windriver/802/wdusb_man_mhtml/node55.html#SECTION001213000000000000000 */
@@ -269,12 +567,60 @@ int xpcu_transfer(struct usb_transfer *ut) {
 	return ret;
 }
 
+/* Cables of different events can be used from several threads at once */
+int xpcu_transfer(struct usb_transfer *ut) {
+	struct xpcu_s *xpcu = (struct xpcu_s*)ut->dwUniqueID;
+	int ret;
+
+	if (!xpcu)
+		return -ENODEV;
+
+	pthread_mutex_lock(&xpcu->lock);
+#ifdef JTAGKEY
+	if (xpcu->ftdi) {
+		pthread_mutex_lock(&ftdi_lock);
+		ret = xpcu_ftdi_transfer(xpcu, ut);
+		pthread_mutex_unlock(&ftdi_lock);
+	} else
+#endif
+		ret = xpcu_usb_transfer(xpcu, ut);
+	pthread_mutex_unlock(&xpcu->lock);
+
+	return ret;
+}
+
 int xpcu_set_interface(struct usb_set_interface *usi) {
 	struct xpcu_s *xpcu = (struct xpcu_s*)usi->dwUniqueID;
+	int ret = 0;
 
 	if (!xpcu)
 		return -ENODEV;
 
+	pthread_mutex_lock(&xpcu->lock);
+#ifdef JTAGKEY
+	if (xpcu->ftdi) {
+		pthread_mutex_lock(&ftdi_lock);
+		if (!xpcu->ftdi_open) {
+			ret = jtagkey_xpcu_open();
+
+			if (ret >= 0) {
+				xpcu->ftdi_open = 1;
+				ret = 0;
+			}
+		}
+		pthread_mutex_unlock(&ftdi_lock);
+
+		if (ret == 0) {
+			xpcu->interface = usi->dwInterfaceNum;
+			xpcu->alternate = usi->dwAlternateSetting;
+		}
+
+		pthread_mutex_unlock(&xpcu->lock);
+
+		return ret;
+	}
+#endif
+
 	if (xpcu->dev) {
 		if (!xpcu->handle) {
 			xpcu->handle = usb_open(xpcu->dev);
@@ -289,8 +635,9 @@ int xpcu_set_interface(struct usb_set_interface *usi) {
 		xpcu->interface = xpcu->dev->config[0].interface[usi->dwInterfaceNum].altsetting[usi->dwAlternateSetting].bInterfaceNumber;
 		xpcu->alternate = usi->dwAlternateSetting;
 	}
+	pthread_mutex_unlock(&xpcu->lock);
 
-	return 0;
+	return ret;
 }
 
 static void xpcu_init(void) {
@@ -304,6 +651,24 @@ static void xpcu_init(void) {
 	busses = usb_get_busses();
 }
 
+static struct xpcu_s *xpcu_add(struct xpcu_event_s *xpcu_event, struct usb_device *dev, unsigned long card_type) {
+	struct xpcu_s *xpcu;
+	int n = xpcu_event->count;
+
+	xpcu = realloc(xpcu_event->xpcu, sizeof(struct xpcu_s) * (++xpcu_event->count));
+	if (!xpcu)
+		return NULL;
+
+	bzero(&(xpcu[n]), sizeof(struct xpcu_s));
+	xpcu[n].interface = -1;
+	xpcu[n].alternate = -1;
+	xpcu[n].dev = dev;
+	xpcu[n].card_type = card_type;
+
+	xpcu_event->xpcu = xpcu;
+
+	return xpcu;
+}
 
 int xpcu_find(struct event *e) {
 	struct xpcu_event_s *xpcu_event = NULL;
@@ -312,11 +677,12 @@ int xpcu_find(struct event *e) {
 	struct usb_bus *bus;
 	int busnum = -1, devnum = -1;
 	int i;
+#ifdef JTAGKEY
+	int ftdi_found = 0;
+#endif
 
 	e->handle = (unsigned long)NULL;
 
-	xpcu_init();
-
 	usbdev = getenv("XILINX_USB_DEV");
 	if (usbdev != NULL) {
 		int j;
@@ -363,6 +729,10 @@ int xpcu_find(struct event *e) {
 	xpcu_event->count = 0;
 	xpcu_event->interrupt_count = 0;
 	pthread_mutex_init(&xpcu_event->interrupt, NULL);
+	pthread_mutex_init(&xpcu_event->lock, NULL);
+
+	pthread_mutex_lock(&busses_lock);
+	xpcu_init();
 
 	for (i = 0; i < e->dwNumMatchTables; i++) {
 
@@ -403,31 +773,50 @@ int xpcu_find(struct event *e) {
 
 							if ((interface->altsetting[ai].bInterfaceSubClass == e->matchTables[i].bInterfaceSubClass) &&
 									(interface->altsetting[ai].bInterfaceProtocol == e->matchTables[i].bInterfaceProtocol)){
-								int n = xpcu_event->count;
-
 								/* TODO: check interfaceClass! */
 								DPRINTF("found device with libusb\n");
 
-								xpcu = realloc(xpcu, sizeof(struct xpcu_s) * (++xpcu_event->count));
+								xpcu = xpcu_add(xpcu_event, dev, e->dwCardType);
 								if (!xpcu) {
+									pthread_mutex_unlock(&busses_lock);
 									free(xpcu_event);
 									return -ENOMEM;
 								}
-
-								bzero(&(xpcu[n]), sizeof(struct xpcu_s));
-								xpcu[n].interface = -1;
-								xpcu[n].alternate = -1;
-								xpcu[n].dev = dev;
-								xpcu[n].card_type = e->dwCardType;
-
-								xpcu_event->xpcu = xpcu;
 							}
 						}
 					}
 				}
 			}
 		}
+
+#ifdef JTAGKEY
+		if ((devnum == -1) && !ftdi_found &&
+				(e->matchTables[i].VendorId == XPCU_VID) &&
+				(e->matchTables[i].ProductId == XPCU_PID) &&
+				config_xpcu_ftdi()) {
+			struct usb_device *dev;
+
+			DPRINTF("presenting FTDI cable as platform cable USB\n");
+
+			dev = xpcu_ftdi_device(&e->matchTables[i]);
+			xpcu = dev ? xpcu_add(xpcu_event, dev, e->dwCardType) : NULL;
+			if (!xpcu) {
+				free(dev);
+				pthread_mutex_unlock(&busses_lock);
+				free(xpcu_event);
+				return -ENOMEM;
+			}
+
+			xpcu[xpcu_event->count-1].ftdi = 1;
+			ftdi_found = 1;
+		}
+#endif
 	}
+	pthread_mutex_unlock(&busses_lock);
+
+	/* the array doesn't move anymore */
+	for (i = 0; i < xpcu_event->count; i++)
+		pthread_mutex_init(&(xpcu_event->xpcu[i].lock), NULL);
 
 	e->handle = (unsigned long)xpcu_event;
 
@@ -438,8 +827,12 @@ int xpcu_found(struct event *e) {
 	struct xpcu_event_s *xpcu_event = (struct xpcu_event_s*)e->handle;
 	struct xpcu_s *xpcu = NULL;
 
-	if (xpcu_event && xpcu_event->count && (xpcu_event->interrupt_count <= xpcu_event->count))
-		xpcu = &(xpcu_event->xpcu[xpcu_event->interrupt_count-1]);
+	if (xpcu_event) {
+		pthread_mutex_lock(&xpcu_event->lock);
+		if (xpcu_event->count && (xpcu_event->interrupt_count <= xpcu_event->count))
+			xpcu = &(xpcu_event->xpcu[xpcu_event->interrupt_count-1]);
+		pthread_mutex_unlock(&xpcu_event->lock);
+	}
 
 	if (xpcu && xpcu->dev) {
 		struct usb_interface *interface = xpcu->dev->config->interface;
@@ -472,16 +865,37 @@ int xpcu_close(struct event *e) {
 
 		for (i = 0; i < xpcu_event->count; i++) {
 			xpcu = &(xpcu_event->xpcu[i]);
+
+			/* wait for a transfer in progress */
+			pthread_mutex_lock(&xpcu->lock);
+#ifdef JTAGKEY
+			if (xpcu->ftdi) {
+				pthread_mutex_lock(&ftdi_lock);
+				if (xpcu->ftdi_open)
+					jtagkey_xpcu_close();
+				pthread_mutex_unlock(&ftdi_lock);
+				free(xpcu->clk);
+				free(xpcu->tdo);
+				free(xpcu->dev);
+			} else
+#endif
 			if (xpcu->handle) {
 				xpcu_claim(xpcu, XPCU_RELEASE);
 				usb_close(xpcu->handle);
 			}
+			pthread_mutex_unlock(&xpcu->lock);
+			pthread_mutex_destroy(&xpcu->lock);
 		}
 
 		if (xpcu_event->xpcu)
 			free(xpcu_event->xpcu);
 
+		/* rescanned with the next EVENT_REGISTER */
+		pthread_mutex_lock(&busses_lock);
 		busses = NULL;
+		pthread_mutex_unlock(&busses_lock);
+
+		pthread_mutex_destroy(&xpcu_event->lock);
 		free(xpcu_event);
 	}
 
@@ -521,7 +935,10 @@ int xpcu_int_wait(struct interrupt *it) {
 		pthread_mutex_lock(&xpcu_event->interrupt);
 		pthread_mutex_unlock(&xpcu_event->interrupt);
 	}
+
+	pthread_mutex_lock(&xpcu_event->lock);
 	xpcu_event->interrupt_count++;
+	pthread_mutex_unlock(&xpcu_event->lock);
 
 	return 0;
 }